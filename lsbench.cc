@@ -0,0 +1,233 @@
+#include "lsystems.h"
+#include <string>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+/* benchmarks over a corpus of grammars, written to stdout as json:
+
+     lsbench [-j threads] [-r repeats] [-m modules] [-s seed]
+	     grammar[:generations]...
+
+   each grammar is measured in a process of its own, so its peak rss is
+   its own. it is derived one flat generation at a time until the string
+   has more than -m modules (at most 64 generations) or to the generation
+   count after the colon, timing each generation. the whole derivation is then timed
+   again with 1, 2, 4, ... up to -j threads, the best of -r runs each */
+
+static double now() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static char *slurp(const char *path, size_t *len) {
+  FILE *f = fopen(path, "rb");
+  if (!f)
+    return 0;
+  fseek(f, 0, SEEK_END);
+  long n = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  char *text = (char *) malloc(n + 1);
+  *len = fread(text, 1, n, f);
+  text[*len] = 0;
+  fclose(f);
+  return text;
+}
+
+static void json_string(const char *s) {
+  putchar('"');
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\')
+      printf("\\%c", *s);
+    else if ((unsigned char) *s < 0x20)
+      printf("\\u%04x", *s);
+    else
+      putchar(*s);
+  } putchar('"');
+}
+
+/* modules, not counting brackets */
+static long modules(const ls_string *s) {
+  long n = 0;
+  for (int i = 0; i < ls_length(s); i++)
+    if (s->symbol[i] >= 0)
+      n++;
+  return n;
+}
+
+typedef struct t_bench {
+  int threads, repeats;
+  long budget;
+  unsigned long long seed;
+} bench;
+
+/* measure one grammar and print its json object; the exit status */
+static int measure(bench *b, const char *path, int limit) {
+  size_t len;
+  char *text = slurp(path, &len);
+  if (!text) {
+    fprintf(stderr, "lsbench: couldn't read %s\n", path);
+    return -1;
+  }
+
+  /* parsing. each load keeps its grammar, so the first is the one used */
+  lsystem *ls = 0;
+  double parse = 1e30;
+  for (int r = 0; r < b->repeats; r++) {
+    double t = now();
+    lsystem *l = ls_load_from_buffer(text, len);
+    t = now() - t;
+    if (!l)
+      return -1;
+    if (t < parse)
+      parse = t;
+    if (!ls)
+      ls = l;
+  }
+
+  printf("{\"grammar\": ");
+  json_string(path);
+  printf(", \"bytes\": %lu, \"productions\": %d, \"parse_seconds\": %.9f,\n",
+	 (unsigned long) len, (int) ls->productions.size(), parse);
+
+  /* generation by generation */
+  printf("  \"generations\": [");
+  ls_derivation *d = ls_begin(ls, b->seed);
+  ls_string *s = ls_step_flat(d);
+  int n = 0;
+  double total = 0;
+  while (limit < 0 ? modules(s) <= b->budget && n < 64 : n < limit) {
+    double t = now();
+    s = ls_step_flat(d);
+    t = now() - t;
+    total += t;
+    long m = modules(s);
+    n++;
+    printf("%s\n    {\"generation\": %d, \"modules\": %ld, \"entries\": %d,"
+	   " \"seconds\": %.9f, \"modules_per_second\": %.1f}",
+	   n > 1 ? "," : "", n, m, ls_length(s), t, t > 0 ? m / t : 0);
+  }
+  long last = modules(s);
+  ls_end(d);
+  printf("\n  ],\n  \"derive_seconds\": %.9f,\n", total);
+  fprintf(stderr, "%s: %d generations, %ld modules, %.3fs\n",
+	  path, n, last, total);
+
+  /* thread scaling over the same derivation */
+  printf("  \"threads\": [");
+  double one = 0;
+  for (int t = 1; ; t *= 2) {
+    if (t > b->threads)
+      t = b->threads;
+    ls_set_threads(ls, t);
+    double best = 1e30;
+    for (int r = 0; r < b->repeats; r++) {
+      ls_seed(ls, b->seed);
+      double start = now();
+      ls_run_flat(ls, n);
+      start = now() - start;
+      if (start < best)
+	best = start;
+    }
+    if (t == 1)
+      one = best;
+    printf("%s\n    {\"threads\": %d, \"seconds\": %.9f,"
+	   " \"modules_per_second\": %.1f, \"speedup\": %.3f}",
+	   t > 1 ? "," : "", t, best, best > 0 ? last / best : 0,
+	   best > 0 ? one / best : 0);
+    if (t == b->threads)
+      break;
+  } ls_set_threads(ls, 1);
+
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  printf("\n  ],\n  \"peak_rss_kb\": %ld}", ru.ru_maxrss);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  bench b;
+  b.threads = sysconf(_SC_NPROCESSORS_ONLN);
+  b.repeats = 3;
+  b.budget = 1000000;
+  b.seed = 1;
+  while (argc > 1 && argv[1][0] == '-' && argc > 2) {
+    if (!strcmp(argv[1], "-j"))
+      b.threads = atoi(argv[2]);
+    else if (!strcmp(argv[1], "-r"))
+      b.repeats = atoi(argv[2]);
+    else if (!strcmp(argv[1], "-m"))
+      b.budget = atol(argv[2]);
+    else if (!strcmp(argv[1], "-s"))
+      b.seed = strtoull(argv[2], 0, 10);
+    else
+      break;
+    argc -= 2;
+    argv += 2;
+  }
+
+  if (argc < 2 || b.threads < 1 || b.repeats < 1) {
+    printf("usage: lsbench [-j threads] [-r repeats] [-m modules] [-s seed] grammar[:generations]...\n");
+    return 0;
+  }
+
+  printf("{\"seed\": %llu, \"repeats\": %d, \"module_budget\": %ld,"
+	 " \"max_threads\": %d,\n \"grammars\": [\n", b.seed, b.repeats,
+	 b.budget, b.threads);
+  int failed = 0;
+  for (int i = 1; i < argc; i++) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s", argv[i]);
+    int limit = -1;
+    char *colon = strrchr(path, ':');
+    if (colon) {
+      *colon = 0;
+      limit = atoi(colon + 1);
+    }
+
+    /* the child's object comes back through a pipe, so a child that
+       fails partway leaves no half an object in the output */
+    int fd[2];
+    if (pipe(fd)) {
+      fprintf(stderr, "lsbench: no pipe\n");
+      return -1;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(fd[0]);
+      dup2(fd[1], 1);
+      int status = measure(&b, path, limit);
+      fflush(stdout);
+      _exit(status ? 1 : 0);
+    }
+
+    close(fd[1]);
+    std::string object;
+    char buf[4096];
+    ssize_t got;
+    while ((got = read(fd[0], buf, sizeof(buf))) > 0)
+      object.append(buf, got);
+    close(fd[0]);
+
+    int status;
+    printf("%s", i > 1 ? ",\n" : "");
+    if (pid < 0 || waitpid(pid, &status, 0) < 0 ||
+	!WIFEXITED(status) || WEXITSTATUS(status)) {
+      fprintf(stderr, "lsbench: %s failed\n", path);
+      printf("{\"grammar\": ");
+      json_string(path);
+      printf(", \"failed\": true}");
+      failed++;
+    } else
+      printf("%s", object.c_str());
+  }
+
+  printf("\n]}\n");
+  return failed ? -1 : 0;
+}
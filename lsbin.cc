@@ -0,0 +1,349 @@
+#include "lsbin.h"
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+typedef unsigned int u32;
+typedef unsigned long long u64;
+
+static const char header_magic[8] = "LSYSBIN";
+static const char footer_magic[8] = "LSYSEND";
+
+typedef struct t_bin_footer {
+  u64 index, symbols, nmodules, nparams;
+  u32 nblocks, version;
+  char magic[8];
+} bin_footer;
+
+/* the arrays are written and mapped as they are in memory */
+static bool little_endian() {
+  u32 one = 1;
+  return *(unsigned char *) &one == 1;
+}
+
+static size_t padding(size_t n) {
+  return (8 - (n & 7)) & 7;
+}
+
+/* writing */
+
+struct t_ls_bin_writer {
+  FILE *f;
+  bool owned, failed;
+  u64 offset, nmodules, nparams;
+  std::vector<u64> block_offset, block_first;
+
+  std::vector<int> local;	/* interned id -> the file's id + 1 */
+  std::vector<int> names;	/* the file's id -> interned id */
+
+  std::vector<int> symbol;	/* a block being renumbered */
+  std::vector<u32> start;
+  std::vector<double> value;
+};
+
+static void put(ls_bin_writer *w, const void *data, size_t size) {
+  if (size && fwrite(data, 1, size, w->f) != size)
+    w->failed = true;
+  w->offset += size;
+}
+
+static void pad(ls_bin_writer *w) {
+  static const char zero[8] = {0};
+  put(w, zero, padding(w->offset));
+}
+
+static int file_symbol(ls_bin_writer *w, int sym) {
+  if (sym < 0)
+    return sym;			/* a bracket */
+  if (sym >= w->local.size())
+    w->local.resize(sym + 1, 0);
+  if (!w->local[sym]) {
+    w->names.push_back(sym);
+    w->local[sym] = w->names.size();
+  } return w->local[sym] - 1;
+}
+
+ls_bin_writer *ls_bin_writer_new(FILE *f) {
+  if (!little_endian()) {
+    fprintf(stderr, "ls_bin: only little endian machines are supported\n");
+    return 0;
+  }
+
+  ls_bin_writer *w = new ls_bin_writer;
+  w->f = f;
+  w->owned = w->failed = false;
+  w->offset = w->nmodules = w->nparams = 0;
+
+  u32 version[2] = {LS_BIN_VERSION, 0};
+  put(w, header_magic, sizeof(header_magic));
+  put(w, version, sizeof(version));
+  return w;
+}
+
+ls_bin_writer *ls_bin_create(const char *path) {
+  FILE *f = fopen(path, "wb");
+  if (!f) {
+    fprintf(stderr, "ls_bin_create: couldn't open %s\n", path);
+    return 0;
+  }
+
+  ls_bin_writer *w = ls_bin_writer_new(f);
+  if (!w) {
+    fclose(f);
+    return 0;
+  }
+  w->owned = true;
+  return w;
+}
+
+void ls_bin_write(ls_bin_writer *w, const ls_string *s) {
+  u32 n = ls_length(s), m = s->start[n] - s->start[0];
+  if (!n)
+    return;
+
+  w->block_offset.push_back(w->offset);
+  w->block_first.push_back(w->nmodules);
+  w->nmodules += n;
+  w->nparams += m;
+
+  w->symbol.resize(n);
+  for (u32 i = 0; i < n; i++)
+    w->symbol[i] = file_symbol(w, s->symbol[i]);
+  w->start.resize(n + 1);
+  for (u32 i = 0; i <= n; i++)
+    w->start[i] = s->start[i] - s->start[0];
+
+  u32 counts[2] = {n, m};
+  put(w, counts, sizeof(counts));
+  put(w, &w->symbol[0], n * sizeof(int));
+  put(w, &w->start[0], (n + 1) * sizeof(u32));
+  pad(w);
+  if (!m)
+    return;
+
+  /* parameters go out as they are unless some are symbols */
+  const double *value = &s->value[s->start[0]];
+  const unsigned char *type = &s->type[s->start[0]];
+  if (memchr(type, ty_symbol, m)) {
+    w->value.assign(value, value + m);
+    for (u32 k = 0; k < m; k++)
+      if (type[k] == ty_symbol)
+	w->value[k] = file_symbol(w, (int) value[k]);
+    value = &w->value[0];
+  }
+  put(w, value, m * sizeof(double));
+  put(w, type, m);
+  pad(w);
+}
+
+void ls_bin_sink(void *w, const ls_string *s) {
+  ls_bin_write((ls_bin_writer *) w, s);
+}
+
+bool ls_bin_write_sxp(ls_bin_writer *w, sxp *x) {
+  ls_string s;
+  if (!ls_from_sxp(&s, x))
+    return false;
+  ls_bin_write(w, &s);
+  return true;
+}
+
+bool ls_bin_finish(ls_bin_writer *w) {
+  bin_footer footer;
+  footer.index = w->offset;
+  if (!w->block_offset.empty()) {
+    put(w, &w->block_offset[0], w->block_offset.size() * sizeof(u64));
+    put(w, &w->block_first[0], w->block_first.size() * sizeof(u64));
+  }
+
+  footer.symbols = w->offset;
+  u32 count = w->names.size();
+  put(w, &count, sizeof(count));
+  for (u32 i = 0; i < count; i++) {
+    const char *name = sxp_symbol_name(w->names[i]);
+    u32 len = strlen(name);
+    put(w, &len, sizeof(len));
+    put(w, name, len);
+  } pad(w);
+
+  footer.nmodules = w->nmodules;
+  footer.nparams = w->nparams;
+  footer.nblocks = w->block_offset.size();
+  footer.version = LS_BIN_VERSION;
+  memcpy(footer.magic, footer_magic, sizeof(footer.magic));
+  put(w, &footer, sizeof(footer));
+
+  if (fflush(w->f))
+    w->failed = true;
+  if (w->owned && fclose(w->f))
+    w->failed = true;
+  bool ok = !w->failed;
+  delete w;
+  return ok;
+}
+
+/* reading */
+
+static ls_bin *corrupt(const char *path, ls_bin *b) {
+  fprintf(stderr, "ls_bin_open: %s is not a readable lsystem string\n", path);
+  ls_bin_free(b);
+  return 0;
+}
+
+/* map the block at offset, checking it lies within the string's size
+   bytes from base */
+static bool map_block(const char *base, u64 size, u64 offset,
+		      ls_bin_block *k) {
+  if (offset & 7 || offset + 2 * sizeof(u32) > size)
+    return false;
+
+  const u32 *counts = (const u32 *) (base + offset);
+  u64 n = counts[0], m = counts[1];
+  u64 params = offset + 2 * sizeof(u32) + n * sizeof(int) + (n + 1) * sizeof(u32);
+  params += padding(params);
+  if (params + m * (sizeof(double) + 1) > size)
+    return false;
+
+  k->nmodules = n;
+  k->nparams = m;
+  k->symbol = (const int *) (counts + 2);
+  k->start = (const unsigned int *) (k->symbol + n);
+  k->value = (const double *) (base + params);
+  k->type = (const unsigned char *) (k->value + m);
+  return true;
+}
+
+ls_bin *ls_bin_open(const char *path) {
+  return ls_bin_open_at(path, 0);
+}
+
+ls_bin *ls_bin_open_at(const char *path, size_t from) {
+  if (!little_endian()) {
+    fprintf(stderr, "ls_bin: only little endian machines are supported\n");
+    return 0;
+  }
+
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    fprintf(stderr, "ls_bin_open: couldn't open %s\n", path);
+    if (fd >= 0)
+      close(fd);
+    return 0;
+  }
+
+  ls_bin *b = new ls_bin;
+  b->size = st.st_size;
+  b->map = b->size ? mmap(0, b->size, PROT_READ, MAP_PRIVATE, fd, 0) : 0;
+  close(fd);
+  if (b->map == MAP_FAILED)
+    b->map = 0;
+  if (!b->map || from & 7 || b->size < from
+      || b->size - from < sizeof(header_magic) + 8 + sizeof(bin_footer))
+    return corrupt(path, b);
+
+  /* from here on offsets count from the string's header */
+  const char *base = (const char *) b->map + from;
+  u64 size = b->size - from;
+  bin_footer footer;
+  memcpy(&footer, base + size - sizeof(footer), sizeof(footer));
+  u32 version = *(const u32 *) (base + sizeof(header_magic));
+  if (memcmp(base, header_magic, sizeof(header_magic))
+      || memcmp(footer.magic, footer_magic, sizeof(footer_magic)))
+    return corrupt(path, b);
+  if (version != LS_BIN_VERSION || footer.version != LS_BIN_VERSION) {
+    fprintf(stderr, "ls_bin_open: %s is version %u, not %d\n", path,
+	    version, LS_BIN_VERSION);
+    ls_bin_free(b);
+    return 0;
+  }
+
+  u64 end = size - sizeof(footer);
+  if (footer.index & 7 || footer.index > end
+      || footer.nblocks > (end - footer.index) / (2 * sizeof(u64)))
+    return corrupt(path, b);
+  b->nmodules = footer.nmodules;
+  b->nparams = footer.nparams;
+
+  const u64 *offset = (const u64 *) (base + footer.index);
+  b->blocks.resize(footer.nblocks);
+  for (u32 i = 0; i < footer.nblocks; i++)
+    if (!map_block(base, size, offset[i], &b->blocks[i]))
+      return corrupt(path, b);
+
+  /* the names are interned once here, so symbols read from the blocks
+     need only a table lookup */
+  u64 at = footer.symbols;
+  if (at + sizeof(u32) > end)
+    return corrupt(path, b);
+  u32 count, len;
+  memcpy(&count, base + at, sizeof(u32));
+  at += sizeof(u32);
+  for (u32 i = 0; i < count; i++) {
+    if (at + sizeof(u32) > end)
+      return corrupt(path, b);
+    memcpy(&len, base + at, sizeof(u32));
+    at += sizeof(u32);
+    if (len > end - at)
+      return corrupt(path, b);
+    b->symbols.push_back(sxp_intern_n(base + at, len));
+    at += len;
+  } return b;
+}
+
+void ls_bin_free(ls_bin *b) {
+  if (b->map)
+    munmap(b->map, b->size);
+  delete b;
+}
+
+int ls_bin_symbol(const ls_bin *b, int sym) {
+  return sym < 0 ? sym : b->symbols[sym];
+}
+
+/* the blocks are checked here rather than when the file is opened,
+   which would read all of it */
+bool ls_bin_to_string(const ls_bin *b, ls_string *out) {
+  int nsymbols = b->symbols.size(), depth = 0;
+  for (int i = 0; i < b->blocks.size(); i++) {
+    const ls_bin_block &k = b->blocks[i];
+    if (k.start[0] != 0)
+      return false;
+    for (u32 j = 0; j < k.nmodules; j++) {
+      int sym = k.symbol[j];
+      if (sym >= nsymbols || sym < LS_CLOSE || k.start[j + 1] < k.start[j]
+	  || k.start[j + 1] > k.nparams)
+	return false;
+      if (sym < 0 && k.start[j + 1] != k.start[j])
+	return false;		/* brackets take no parameters */
+      if (sym == LS_OPEN)
+	++depth;
+      else if (sym == LS_CLOSE && --depth < 0)
+	return false;
+
+      ls_push_module(out, ls_bin_symbol(b, sym));
+      for (u32 p = k.start[j]; p < k.start[j + 1]; p++) {
+	double v = k.value[p];
+	if (k.type[p] != ty_float && k.type[p] != ty_integer
+	    && k.type[p] != ty_symbol)
+	  return false;
+	if (k.type[p] == ty_symbol) {
+	  if (!(v >= 0 && v < nsymbols) || v != (int) v)
+	    return false;
+	  v = ls_bin_symbol(b, (int) v);
+	} ls_push_param(out, k.type[p], v);
+      }
+    }
+  } return depth == 0;
+}
+
+sxp *ls_bin_to_sxp(const ls_bin *b) {
+  ls_string s;
+  if (!ls_bin_to_string(b, &s)) {
+    fprintf(stderr, "ls_bin_to_sxp: the file is corrupt\n");
+    return 0;
+  } return ls_to_sxp(&s);
+}
@@ -0,0 +1,66 @@
+#ifndef LSBIN_H
+#define LSBIN_H
+
+#include "lsstring.h"
+#include "lsstream.h"
+#include <stdio.h>
+
+/* a binary file format for derived strings, so they can be written and
+   read back without printing and parsing text. everything is little
+   endian, and every array is 8 byte aligned from the start of the file:
+
+     header	"LSYSBIN" 0, u32 version, u32 0
+     blocks	u32 modules n, u32 parameters m,
+		i32 symbol[n], u32 start[n + 1], padding to 8,
+		f64 value[m], u8 type[m], padding to 8
+     index	u64 offset of each block, u64 modules before each block
+     symbols	u32 count, then per symbol u32 length and its name,
+		padding to 8
+     footer	u64 index offset, u64 symbols offset, u64 modules,
+		u64 parameters, u32 blocks, u32 version, "LSYSEND" 0
+
+   a block is the modules of one ls_bin_write, with start counted from the
+   block's first parameter. symbols, including the values of ty_symbol
+   parameters, are numbered by the file's own table, in the order they were
+   first written; LS_OPEN and LS_CLOSE are kept as they are. as the index
+   and symbols come last, a writer streams blocks out as it gets them */
+
+#define LS_BIN_VERSION 1
+
+typedef struct t_ls_bin_writer ls_bin_writer;
+
+ls_bin_writer *ls_bin_create(const char *path);	/* 0 if it can't */
+ls_bin_writer *ls_bin_writer_new(FILE *f);	/* f isn't closed */
+void ls_bin_write(ls_bin_writer *w, const ls_string *s);
+void ls_bin_sink(void *w, const ls_string *s);	/* an ls_sink */
+bool ls_bin_write_sxp(ls_bin_writer *w, sxp *x);
+bool ls_bin_finish(ls_bin_writer *w);	/* false if a write failed */
+
+/* a file mapped for reading. the blocks point into the mapping, so
+   reading costs nothing until the arrays are looked at */
+typedef struct t_ls_bin_block {
+  unsigned int nmodules, nparams;
+  const int *symbol;
+  const unsigned int *start;
+  const double *value;
+  const unsigned char *type;
+} ls_bin_block;
+
+typedef struct t_ls_bin {
+  void *map;
+  size_t size;
+  unsigned long long nmodules, nparams;
+  std::vector<ls_bin_block> blocks;
+  std::vector<int> symbols;	/* the file's ids -> interned ids */
+} ls_bin;
+
+ls_bin *ls_bin_open(const char *path);	/* 0 if it isn't one */
+/* a string written from byte from of a file, a multiple of 8 */
+ls_bin *ls_bin_open_at(const char *path, size_t from);
+void ls_bin_free(ls_bin *b);
+int ls_bin_symbol(const ls_bin *b, int sym);	/* interned id */
+/* append the whole string to out, false if the blocks are corrupt */
+bool ls_bin_to_string(const ls_bin *b, ls_string *out);
+sxp *ls_bin_to_sxp(const ls_bin *b);
+
+#endif
@@ -0,0 +1,454 @@
+#include "lsystems.h"
+#include "lscheckpoint.h"
+#include "lscompiled.h"
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+/* the grammar compiler. it loads a grammar with ls_load and writes a
+   rewriter for it alone as c++:
+
+     lsc grammar.ls rewriter.cc
+     g++ -O2 -ffp-contract=off -fPIC -shared -I<here> -o rewriter.so rewriter.cc
+
+   the rewriter switches on the symbol of each module, and each
+   production it might try is a function of its own: context found with
+   a bracket walk per context module, parameters bound into a struct
+   with a field per formal parameter, the condition and arguments as c++
+   arithmetic, and stochastic choices as a chain of comparisons. it is
+   the grammar after ls_optimize, so dead productions are left out and
+   constants come folded.
+
+   the arithmetic is the evaluator's, operand by operand in the same
+   order, so the strings are the ones ls_run_flat derives; that's why
+   -ffp-contract=off, which keeps the c++ compiler from fusing a
+   multiply and add into one rounding. a grammar the rewriter can't
+   reproduce exactly, such as a list nested in a module's parameters,
+   is refused */
+
+typedef struct t_generator {
+  FILE *f;
+  const char *grammar, *output;
+  std::vector<int> symbols;	/* the rewriter's numbers -> symbol id */
+} generator;
+
+static void refuse(generator *g, int k, const char *why, ...) {
+  va_list args;
+  fprintf(stderr, "lsc: %s: production %d ", g->grammar, k);
+  va_start(args, why);
+  vfprintf(stderr, why, args);
+  va_end(args);
+  fprintf(stderr, "\n");
+  fclose(g->f);
+  remove(g->output);
+  exit(-1);
+}
+
+static int number_of(generator *g, int sym) {
+  for (int i = 0; i < g->symbols.size(); i++)
+    if (g->symbols[i] == sym)
+      return i;
+  g->symbols.push_back(sym);
+  return g->symbols.size() - 1;
+}
+
+static std::string format(const char *fmt, ...) {
+  char buf[256];
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(buf, sizeof(buf), fmt, args);
+  va_end(args);
+  return buf;
+}
+
+/* a c++ double literal of exactly v */
+static std::string literal(double v) {
+  if (isnan(v))
+    return "__builtin_nan(\"\")";
+  if (isinf(v))
+    return v > 0 ? "__builtin_inf()" : "(-__builtin_inf())";
+  std::string s = format("%.17g", v);
+  if (s.find_first_of(".e") == std::string::npos)
+    s += ".0";
+  return signbit(v) ? "(" + s + ")" : s;
+}
+
+static std::string symbol(generator *g, int sym) {
+  return format("sym[%d]", number_of(g, sym));
+}
+
+static int slot_of(production *p, int sym) {
+  for (int i = 0; i < p->params.size(); i++)
+    if (p->params[i] == sym)
+      return i;
+  return -1;
+}
+
+/* expressions, as the evaluator computes them */
+
+static std::string expression(generator *g, production *p, int k, sxp *expr);
+
+static std::string operand(generator *g, production *p, int k, sxp *a) {
+  switch (a->type) {
+  case ty_integer:
+    return literal(a->Z);
+  case ty_float:
+    return literal(a->R);
+  case ty_symbol:
+    if (slot_of(p, a->sym) < 0)
+      refuse(g, k, "computes with %s, which isn't a parameter",
+	     sxp_symbol_name(a->sym));
+    return format("m.p%d", slot_of(p, a->sym));
+  }
+  if (!a->down || a->down->type != ty_symbol
+      || ls_operator(a->down->sym) == op_none)
+    refuse(g, k, "computes with a list");
+  return "(" + expression(g, p, k, a->down) + ")";
+}
+
+static std::string expression(generator *g, production *p, int k, sxp *expr) {
+  int op = ls_operator(expr->sym);
+  std::vector<std::string> args;
+  for (sxp *a = expr->next; a; a = a->next)
+    args.push_back(operand(g, p, k, a));
+  int n = args.size();
+  std::string s;
+
+  switch (op) {
+  case op_add:
+    /* from 0, like ls_eval_add: 0 + -0 is 0 */
+    s = "0.0";
+    for (int i = 0; i < n; i++)
+      s += " + " + args[i];
+    return s;
+  case op_sub:
+  case op_mul:
+  case op_div:
+    if (n == 0)
+      return op == op_mul ? "1.0" : "0.0";
+    s = args[0];
+    for (int i = 1; i < n; i++)
+      s += (op == op_sub ? " - " : op == op_mul ? " * " : " / ") + args[i];
+    return s;
+
+  case op_eq:
+  case op_lt:
+  case op_gt:
+  case op_lte:
+  case op_gte: {
+    static const char *compare[] = {"==", "<", ">", "<=", ">="};
+    const char *c = compare[op == op_eq ? 0 : op - op_lt + 1];
+    if (n != 2)
+      refuse(g, k, "compares %d operands", n);
+    return args[0] + " " + c + " " + args[1] + " ? 1.0 : 0.0";
+  }
+  case op_not:
+    if (n != 1)
+      refuse(g, k, "negates %d operands", n);
+    return args[0] + " == 0 ? 1.0 : 0.0";
+
+  case op_and:
+  case op_or:
+    /* short circuits where the compiled programs do: and on an operand
+       of 0, or on one of 1 */
+    if (n == 0)
+      return op == op_and ? "1.0" : "0.0";
+    for (int i = 0; i < n; i++)
+      s += (i ? (op == op_and ? " && " : " || ") : "") + args[i]
+	+ (op == op_and ? " != 0" : " == 1");
+    return s + " ? 1.0 : 0.0";
+  } return "";
+}
+
+/* matching. the module at j is the nth of the pattern; bind_params and
+   ls_match_params, unrolled */
+
+static void match_module(generator *g, production *p, int n, sxp *rule,
+			 bool center, std::vector<bool> &seen) {
+  FILE *f = g->f;
+  const int *slot = &p->slots[n][1];
+  int params = sxp_length(rule->next);
+
+  if (center)
+    fprintf(f, "  if (ls_nparams(in, j) != %d)\n", params);
+  else
+    fprintf(f, "  if (in->symbol[j] != %s || ls_nparams(in, j) != %d)\n",
+	    symbol(g, rule->sym).c_str(), params);
+  fprintf(f, "    return false;\n");
+  if (!params)
+    return;
+
+  fprintf(f, "  at = in->start[j];\n");
+  int i = 0;
+  for (sxp *t = rule->next; t; t = t->next, i++) {
+    if (t->type != ty_symbol) {
+      /* neither matcher matches literal parameters */
+      fprintf(f, "  return false;\t\t/* a number in the pattern */\n");
+      return;
+    }
+
+    int s = slot[i];
+    fprintf(f, "  if (in->type[at + %d] == ty_symbol) {\n"
+	    "    if ((int) in->value[at + %d] != %s)\n"
+	    "      return false;\n", i, i, symbol(g, t->sym).c_str());
+    if (seen[s])
+      fprintf(f, "  } else if (bound & (1ULL << %d)) {\n"
+	      "    if (m.p%d != in->value[at + %d])\n"
+	      "      return false;\n", s, s, i);
+    fprintf(f, "  } else {\n"
+	    "    m.p%d = in->value[at + %d];\n"
+	    "    bound |= 1ULL << %d;\n"
+	    "  }\n", s, i, s);
+    seen[s] = true;
+  }
+}
+
+/* expansions, as vm_expand_flat emits them */
+
+static void emit_list(generator *g, production *p, int k, sxp *list,
+		      int depth);
+
+static void emit_module(generator *g, production *p, int k, sxp *m,
+			int depth) {
+  FILE *f = g->f;
+  const char *pad = depth ? "  " : "";
+  fprintf(f, "%s  ls_push_module(out, %s);\n", pad,
+	  symbol(g, m->sym).c_str());
+
+  for (sxp *a = m->next; a; a = a->next) {
+    int s;
+    switch (a->type) {
+    case ty_integer:
+      fprintf(f, "%s  ls_push_param(out, ty_integer, %d);\n", pad, a->Z);
+      break;
+    case ty_float:
+      fprintf(f, "%s  ls_push_param(out, ty_float, %s);\n", pad,
+	      literal(a->R).c_str());
+      break;
+    case ty_symbol:
+      if ((s = slot_of(p, a->sym)) < 0) {
+	fprintf(f, "%s  ls_push_param(out, ty_symbol, %s);\n", pad,
+		symbol(g, a->sym).c_str());
+	break;
+      }
+      fprintf(f, "%s  if (bound & (1ULL << %d))\n"
+	      "%s    ls_push_param(out, ty_float, m.p%d);\n"
+	      "%s  else\n"
+	      "%s    ls_push_param(out, ty_symbol, %s);\n", pad, s, pad, s,
+	      pad, pad, symbol(g, a->sym).c_str());
+      break;
+    case ty_sxp:
+      if (!a->down || a->down->type != ty_symbol
+	  || ls_operator(a->down->sym) == op_none)
+	refuse(g, k, "nests a list in a module, which a flat string can't");
+      fprintf(f, "%s  ls_push_param(out, ty_float, %s);\n", pad,
+	      operand(g, p, k, a).c_str());
+      break;
+    }
+  }
+}
+
+static void emit_list(generator *g, production *p, int k, sxp *list,
+		      int depth) {
+  FILE *f = g->f;
+  const char *pad = depth ? "  " : "";
+  for (sxp *r = list; r; r = r->next) {
+    sxp *d = r->down;
+    if (r->type != ty_sxp)
+      refuse(g, k, "expands to something not a module or branch");
+    if (d && d->type == ty_symbol && ls_operator(d->sym) == op_none)
+      emit_module(g, p, k, d, depth);
+    else if (!d || d->type == ty_sxp) {
+      /* an empty element is an empty branch, as in ls_append_element */
+      fprintf(f, "%s  ls_push_module(out, LS_OPEN);\n", pad);
+      emit_list(g, p, k, d, depth);
+      fprintf(f, "%s  ls_push_module(out, LS_CLOSE);\n", pad);
+    } else
+      refuse(g, k, "expands to something that doesn't fit a flat string");
+  }
+}
+
+static void write_production(generator *g, lsystem *ls, int k) {
+  FILE *f = g->f;
+  production *p = ls->productions[k];
+  int nleft = p->left.size(), nright = p->right.size();
+
+  fprintf(f, "/* production %d:", k);
+  for (int i = 0; i < nleft; i++)
+    fprintf(f, " %s", sxp_symbol_name(p->left[i]->sym));
+  fprintf(f, "%s %s%s", nleft ? " <" : "", sxp_symbol_name(p->symbol),
+	  nright ? " >" : "");
+  for (int i = 0; i < nright; i++)
+    fprintf(f, " %s", sxp_symbol_name(p->right[i]->sym));
+  fprintf(f, " */\n");
+
+  fprintf(f, "struct params_%d {\n", k);
+  for (int s = 0; s < p->params.size(); s++)
+    fprintf(f, "  double p%d;\t\t/* %s */\n", s,
+	    sxp_symbol_name(p->params[s]));
+  fprintf(f, "};\n\n");
+
+  fprintf(f, "static bool production_%d(const ls_compiled_args *a, int i) {\n"
+	  "  const ls_string *in = a->in;\n"
+	  "  ls_string *out = a->out;\n"
+	  "  const int *sym = a->symbol;\n"
+	  "  params_%d m = {};\n"
+	  "  unsigned long long bound = 0;\n"
+	  "  unsigned int at = 0;\n"
+	  "  int j = i;\n"
+	  "  (void) out, (void) sym, (void) m, (void) bound, (void) at;\n",
+	  k, k);
+  if (nright)
+    fprintf(f, "  int n = ls_length(in);\n");
+
+  /* the left context, nearest first, on the walk back toward the root */
+  std::vector<bool> seen(p->params.size(), false);
+  for (int n = nleft - 1; n >= 0; n--) {
+    fprintf(f, "  if ((j = left_neighbour(a->brackets, j)) < 0)\n"
+	    "    return false;\n");
+    match_module(g, p, n, p->left[n], false, seen);
+  }
+  if (nleft)
+    fprintf(f, "  j = i;\n");
+  int pattern = nleft;
+  match_module(g, p, pattern++, p->center, true, seen);
+  for (int n = 0; n < nright; n++) {
+    fprintf(f, "  if ((j = right_neighbour(a->brackets, n, j)) < 0)\n"
+	    "    return false;\n");
+    match_module(g, p, pattern++, p->right[n], false, seen);
+  }
+
+  if (p->condition) {
+    if (p->condition->type != ty_symbol
+	|| ls_operator(p->condition->sym) == op_none)
+      refuse(g, k, "has a condition that isn't arithmetic");
+    fprintf(f, "  if (!((%s) > 0))\n    return false;\n",
+	    expression(g, p, k, p->condition).c_str());
+  }
+
+  /* a plain production takes its one expansion without drawing */
+  fprintf(f, "\n");
+  std::vector<double> &sum = p->cumulative;
+  if (sum.size() == 1 && sum[0] >= 1)
+    emit_list(g, p, k, p->expansion[0]->expansion, 0);
+  else {
+    fprintf(f, "  double draw = ls_rng_uniform(a->seed, a->generation, i);\n");
+    for (int x = 0; x < sum.size(); x++) {
+      fprintf(f, "  %sif (draw < %s) {\n", x ? "} else " : "",
+	      literal(sum[x]).c_str());
+      emit_list(g, p, k, p->expansion[x]->expansion, 1);
+    }
+    fprintf(f, "  }\t\t\t/* past the last, the module is deleted */\n");
+  }
+  fprintf(f, "  return true;\n}\n\n");
+}
+
+static void write_rewriter(generator *g, lsystem *ls) {
+  FILE *f = g->f;
+  fprintf(f, "/* the rewriter of %s, written by lsc; see lscompiled.h */\n\n"
+	  "#include \"lscompiled.h\"\n"
+	  "#include \"lsrng.h\"\n\n"
+	  "/* ls_index_brackets neighbours, as the matchers walk them */\n"
+	  "static inline int left_neighbour(const int *br, int i) {\n"
+	  "  while (--i >= 0) {\n"
+	  "    if (br[i] < 0)\n"
+	  "      return i;\n"
+	  "    if (br[i] < i)\n"
+	  "      i = br[i];\n"
+	  "  } return -1;\n"
+	  "}\n\n"
+	  "static inline int right_neighbour(const int *br, int n, int i) {\n"
+	  "  while (++i < n) {\n"
+	  "    if (br[i] < 0)\n"
+	  "      return i;\n"
+	  "    if (br[i] < i)\n"
+	  "      return -1;\n"
+	  "    i = br[i];\n"
+	  "  } return -1;\n"
+	  "}\n\n", g->grammar);
+
+  for (int s = 0; s < ls->dispatch.size(); s++)
+    for (int j = 0; j < ls->dispatch[s].size(); j++) {
+      production *p = ls->dispatch[s][j];
+      for (int k = 0; k < ls->productions.size(); k++)
+	if (ls->productions[k] == p)
+	  write_production(g, ls, k);
+    }
+
+  fprintf(f, "extern \"C\" void lsc_apply(const ls_compiled_args *a) {\n"
+	  "  const ls_string *in = a->in;\n"
+	  "  int n = ls_length(in);\n"
+	  "  for (int i = 0; i < n; i++) {\n"
+	  "    int id = in->symbol[i];\n"
+	  "    switch (id >= 0 && id < a->nlocal ? a->local[id] : -1) {\n");
+  for (int s = 0; s < ls->dispatch.size(); s++) {
+    std::vector<production *> &candidates = ls->dispatch[s];
+    if (candidates.empty())
+      continue;
+    fprintf(f, "    case %d:\t\t\t/* %s */\n      if (", number_of(g, s),
+	    sxp_symbol_name(s));
+    for (int j = 0; j < candidates.size(); j++)
+      for (int k = 0; k < ls->productions.size(); k++)
+	if (ls->productions[k] == candidates[j])
+	  fprintf(f, "%sproduction_%d(a, i)", j ? "\n\t  || " : "", k);
+    fprintf(f, ")\n\tcontinue;\n      break;\n");
+  }
+  fprintf(f, "    }\n"
+	  "    ls_push_copy(a->out, in, i);\n"
+	  "  }\n"
+	  "}\n\n");
+
+  /* every number is given out by now */
+  fprintf(f, "extern \"C\" const int lsc_version = %d;\n"
+	  "extern \"C\" const unsigned long long lsc_grammar_hash = 0x%016llxULL;\n"
+	  "extern \"C\" const int lsc_nsymbols = %d;\n"
+	  "extern \"C\" const char *const lsc_symbols[] = {\n",
+	  LS_COMPILED_VERSION, ls_grammar_hash(ls), (int) g->symbols.size());
+  for (int i = 0; i < g->symbols.size(); i++) {
+    fprintf(f, "  \"");
+    for (const char *c = sxp_symbol_name(g->symbols[i]); *c; c++) {
+      if (*c == '"' || *c == '\\')
+	fprintf(f, "\\%c", *c);
+      else if ((unsigned char) *c < 0x20)
+	fprintf(f, "\\%03o", (unsigned char) *c);
+      else
+	fputc(*c, f);
+    }
+    fprintf(f, "\",\n");
+  }
+  fprintf(f, "  0\n};\n");
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 3) {
+    printf("usage: lsc grammar.ls rewriter.cc\n");
+    return 0;
+  }
+
+  lsystem *ls = ls_load(argv[1]);
+  if (!ls)
+    return -1;
+
+  generator g;
+  g.grammar = argv[1];
+  g.output = argv[2];
+  g.f = fopen(argv[2], "w");
+  if (!g.f) {
+    fprintf(stderr, "lsc: couldn't open %s\n", argv[2]);
+    return -1;
+  }
+  write_rewriter(&g, ls);
+
+  bool ok = !ferror(g.f);
+  if (fclose(g.f))
+    ok = false;
+  if (!ok) {
+    fprintf(stderr, "lsc: couldn't write %s\n", argv[2]);
+    remove(argv[2]);
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,141 @@
+#include "lscache.h"
+#include "lscheckpoint.h"
+#include <algorithm>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+ls_cache *ls_cache_open(const char *dir, unsigned long long limit) {
+  if (mkdir(dir, 0777) && errno != EEXIST) {
+    fprintf(stderr, "ls_cache_open: couldn't make %s\n", dir);
+    return 0;
+  }
+
+  ls_cache *c = new ls_cache;
+  c->dir = dir;
+  c->limit = limit;
+  c->hits = c->partial = c->misses = c->evictions = 0;
+  return c;
+}
+
+void ls_cache_close(ls_cache *c) {
+  delete c;
+}
+
+/* the seed only matters if some production chooses between expansions */
+static bool draws(lsystem *ls) {
+  for (int i = 0; i < ls->productions.size(); i++) {
+    std::vector<double> &sum = ls->productions[i]->cumulative;
+    if (!ls->productions[i]->dead && (sum.size() != 1 || sum[0] < 1))
+      return true;
+  } return false;
+}
+
+static std::string entry(ls_cache *c, unsigned long long hash,
+			 unsigned long long seed, int n) {
+  char name[64];
+  snprintf(name, sizeof(name), "/%016llx-%016llx-%d.lsc", hash, seed, n);
+  return c->dir + name;
+}
+
+static bool exists(const std::string &path) {
+  struct stat st;
+  return stat(path.c_str(), &st) == 0;
+}
+
+static void store(ls_cache *c, lsystem *ls, const ls_string *s,
+		  unsigned long long seed, const std::string &path) {
+  unsigned long long keep = ls->seed;
+  ls->seed = seed;
+  ls_checkpoint(ls, s, path.c_str());
+  ls->seed = keep;
+  ls_cache_trim(c);
+}
+
+ls_string *ls_run_cached(ls_cache *c, lsystem *ls, int n) {
+  unsigned long long hash = ls_grammar_hash(ls);
+  unsigned long long seed = draws(ls) ? ls->seed : 0;
+  std::string path = entry(c, hash, seed, n);
+
+  /* the deepest generation there is, marked as just used */
+  for (int g = n; g > 0; g--) {
+    std::string from = g == n ? path : entry(c, hash, seed, g);
+    if (!exists(from))
+      continue;
+    utimensat(AT_FDCWD, from.c_str(), 0, 0);
+
+    unsigned long long keep = ls->seed;
+    ls_string *s = ls_resume(ls, n, from.c_str(), 0);
+    ls->seed = keep;		/* 0 in the entry if there are no draws */
+    if (!s && ls->over_budget)
+      return 0;
+    if (!s)
+      break;			/* evicted or damaged; derive it */
+    if (g == n) {
+      c->hits++;
+      return s;
+    }
+
+    c->partial++;
+    store(c, ls, s, seed, path);
+    return s;
+  }
+
+  c->misses++;
+  ls_string *s = ls_run_flat(ls, n);
+  if (s)
+    store(c, ls, s, seed, path);
+  return s;
+}
+
+/* eviction */
+
+typedef struct t_cache_file {
+  std::string path;
+  unsigned long long size;
+  struct timespec used;
+} cache_file;
+
+static bool used_before(const cache_file &a, const cache_file &b) {
+  if (a.used.tv_sec != b.used.tv_sec)
+    return a.used.tv_sec < b.used.tv_sec;
+  return a.used.tv_nsec < b.used.tv_nsec;
+}
+
+void ls_cache_trim(ls_cache *c) {
+  if (!c->limit)
+    return;
+  DIR *d = opendir(c->dir.c_str());
+  if (!d)
+    return;
+
+  std::vector<cache_file> files;
+  unsigned long long total = 0;
+  struct dirent *e;
+  while ((e = readdir(d))) {
+    size_t len = strlen(e->d_name);
+    if (len < 4 || strcmp(e->d_name + len - 4, ".lsc"))
+      continue;
+
+    cache_file f;
+    struct stat st;
+    f.path = c->dir + "/" + e->d_name;
+    if (stat(f.path.c_str(), &st))
+      continue;			/* another process removed it */
+    f.size = st.st_size;
+    f.used = st.st_mtim;
+    total += f.size;
+    files.push_back(f);
+  } closedir(d);
+
+  std::sort(files.begin(), files.end(), used_before);
+  for (int i = 0; i < files.size() && total > c->limit; i++) {
+    if (!unlink(files[i].path.c_str()))
+      c->evictions++;
+    total -= files[i].size;
+  }
+}
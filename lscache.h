@@ -0,0 +1,38 @@
+#ifndef LSCACHE_H
+#define LSCACHE_H
+
+#include "lsystems.h"
+#include <string>
+
+/* a cache of derived generations in a directory, shared by whatever
+   processes use the same directory. an entry is a checkpoint (see
+   lscheckpoint.h) named by what it is generation n of:
+
+     <grammar hash>-<seed>-<n>.lsc
+
+   the seed is 0 for lsystems that never draw, so seeds share entries
+   there. an entry's modification time is when it was last used, and
+   when the files come to more than the limit the least recently used are
+   removed. a request for generation n is served from the deepest entry
+   at or below n, carrying on from it if it's not n itself */
+
+typedef struct t_ls_cache {
+  std::string dir;
+  unsigned long long limit;	/* bytes, 0 for no limit */
+  unsigned long long hits;	/* the generation was there */
+  unsigned long long partial;	/* carried on from an earlier one */
+  unsigned long long misses;	/* derived from the axiom */
+  unsigned long long evictions;
+} ls_cache;
+
+ls_cache *ls_cache_open(const char *dir, unsigned long long limit);
+void ls_cache_close(ls_cache *c);
+
+/* ls_run_flat through the cache, storing generation n if it had to be
+   derived. 0 if it went over ls->memory_limit */
+ls_string *ls_run_cached(ls_cache *c, lsystem *ls, int n);
+
+/* remove least recently used entries until they fit the limit */
+void ls_cache_trim(ls_cache *c);
+
+#endif
@@ -0,0 +1,238 @@
+#include "lscheckpoint.h"
+#include "lsbin.h"
+#include "lstrace.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef unsigned int u32;
+typedef unsigned long long u64;
+
+static const char checkpoint_magic[8] = "LSYSCKP";
+
+typedef struct t_checkpoint_header {
+  char magic[8];
+  u32 version, generation;
+  u64 seed, hash;
+} checkpoint_header;		/* 32 bytes, so the string is aligned */
+
+/* the grammar hash, fnv-1a over a walk of the definition */
+
+static u64 mix(u64 h, const void *data, size_t n) {
+  const unsigned char *p = (const unsigned char *) data;
+  while (n--)
+    h = (h ^ *p++) * 1099511628211ULL;
+  return h;
+}
+
+unsigned long long ls_grammar_hash(lsystem *ls) {
+  u64 h = 14695981039346656037ULL;
+  std::vector<sxp *> stack;
+  sxp *x = ls->definition;
+
+  for (;;) {
+    if (!x) {
+      if (stack.empty())
+	break;
+      h = mix(h, ")", 1);
+      x = stack.back();
+      stack.pop_back();
+      continue;
+    }
+
+    unsigned char type = x->type;
+    h = mix(h, &type, 1);
+    switch (x->type) {
+    case ty_sxp:
+      stack.push_back(x->next);
+      x = x->down;
+      continue;
+    case ty_integer:
+      h = mix(h, &x->Z, sizeof(x->Z));
+      break;
+    case ty_float:
+      h = mix(h, &x->R, sizeof(x->R));
+      break;
+    case ty_symbol: {
+      const char *name = sxp_symbol_name(x->sym);
+      h = mix(h, name, strlen(name) + 1);
+      break;
+    }
+    } x = x->next;
+  } return h;
+}
+
+/* saving */
+
+static bool save(const ls_string *s, int generation, u64 seed, u64 hash,
+		 const char *path) {
+  std::string tmp = std::string(path) + ".tmp";
+  FILE *f = fopen(tmp.c_str(), "wb");
+  if (!f) {
+    fprintf(stderr, "ls_checkpoint: couldn't open %s\n", tmp.c_str());
+    return false;
+  }
+
+  ls_span span;
+  ls_span_begin(&span, ls_trace_phases, "save checkpoint", "generation",
+		generation);
+  checkpoint_header h;
+  memcpy(h.magic, checkpoint_magic, sizeof(h.magic));
+  h.version = LS_CHECKPOINT_VERSION;
+  h.generation = generation;
+  h.seed = seed;
+  h.hash = hash;
+  bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+
+  ls_bin_writer *w = ls_bin_writer_new(f);
+  if (w) {
+    ls_bin_write(w, s);
+    ok = ls_bin_finish(w) && ok;
+  } else
+    ok = false;
+
+  /* on the disk before it replaces the last one */
+  if (fflush(f) || fsync(fileno(f)))
+    ok = false;
+  if (fclose(f))
+    ok = false;
+  if (ok && rename(tmp.c_str(), path))
+    ok = false;
+  if (!ok) {
+    fprintf(stderr, "ls_checkpoint: couldn't write %s\n", path);
+    unlink(tmp.c_str());
+  }
+  ls_span_end(&span);
+  return ok;
+}
+
+bool ls_checkpoint(lsystem *ls, const ls_string *s, const char *path) {
+  return save(s, ls->generation, ls->seed, ls_grammar_hash(ls), path);
+}
+
+/* a save on its own thread */
+typedef struct t_saver {
+  pthread_t thread;
+  bool running, ok;
+  const ls_string *s;
+  int generation;
+  u64 seed, hash;
+  const char *path;
+} saver;
+
+static void *save_main(void *arg) {
+  saver *sv = (saver *) arg;
+  sv->ok = save(sv->s, sv->generation, sv->seed, sv->hash, sv->path);
+  return 0;
+}
+
+static bool wait_saved(saver *sv) {
+  if (sv->running) {
+    pthread_join(sv->thread, 0);
+    sv->running = false;
+  } return sv->ok;
+}
+
+static void start_save(saver *sv, lsystem *ls, const ls_string *s) {
+  wait_saved(sv);		/* one at a time */
+  sv->s = s;
+  sv->generation = ls->generation;
+  sv->seed = ls->seed;
+  if (pthread_create(&sv->thread, 0, save_main, sv)) {
+    save_main(sv);
+    return;
+  } sv->running = true;
+}
+
+/* derivation */
+
+/* rewrite ls->flat[0], generation ls->generation, up to generation n */
+static ls_string *derive(lsystem *ls, int n, const char *path, int k,
+			 const char *who) {
+  ls_string *cur = &ls->flat[0], *next = &ls->flat[1];
+  saver sv;
+  sv.running = false;
+  sv.ok = true;
+  sv.path = path;
+  sv.hash = k > 0 ? ls_grammar_hash(ls) : 0;
+
+  /* the tree walker's temporaries go to the scratch arena */
+  sxp_arena *old = sxp_set_arena(ls->scratch);
+  ls->over_budget = false;
+  while (ls->generation < n) {
+    if (sv.running && sv.s == next)
+      wait_saved(&sv);		/* its string is about to be rewritten */
+    sxp_arena_reset(ls->scratch);
+    ls_apply_flat(ls, cur, next);
+    if (ls->over_budget) {
+      fprintf(stderr, "%s: generation %d would hold more than %lu bytes\n",
+	      who, ls->generation + 1, (unsigned long) ls->memory_limit);
+      cur = 0;			/* the last checkpoint stands */
+      break;
+    }
+    std::swap(cur, next);
+    ls->generation_bytes.push_back(ls_string_bytes(cur));
+    if (k > 0 && ls->generation % k == 0)
+      start_save(&sv, ls, cur);
+  } sxp_set_arena(old);
+
+  wait_saved(&sv);
+  return cur;
+}
+
+ls_string *ls_run_checkpointed(lsystem *ls, int n, const char *path, int k) {
+  ls_string *cur = &ls->flat[0];
+  ls_string_clear(cur);
+  if (!ls_from_sxp(cur, ls->axiom)) {
+    fprintf(stderr, "ls_run_checkpointed: axiom does not fit a flat string\n");
+    exit(-1);
+  } ls->generation_bytes.assign(1, ls_string_bytes(cur));
+  ls->generation = 0;
+  return derive(ls, n, path, k, "ls_run_checkpointed");
+}
+
+ls_string *ls_resume(lsystem *ls, int n, const char *path, int k) {
+  checkpoint_header h;
+  FILE *f = fopen(path, "rb");
+  bool read = f && fread(&h, sizeof(h), 1, f) == 1;
+  if (f)
+    fclose(f);
+  if (!read || memcmp(h.magic, checkpoint_magic, sizeof(h.magic))) {
+    fprintf(stderr, "ls_resume: %s is not a checkpoint\n", path);
+    return 0;
+  }
+  if (h.version != LS_CHECKPOINT_VERSION) {
+    fprintf(stderr, "ls_resume: %s is version %u, not %d\n", path,
+	    h.version, LS_CHECKPOINT_VERSION);
+    return 0;
+  }
+  if (h.hash != ls_grammar_hash(ls)) {
+    fprintf(stderr, "ls_resume: %s is a checkpoint of another grammar\n", path);
+    return 0;
+  }
+  if (h.generation > n) {
+    fprintf(stderr, "ls_resume: %s is already past generation %d\n", path, n);
+    return 0;
+  }
+
+  ls_bin *b = ls_bin_open_at(path, sizeof(h));
+  if (!b)
+    return 0;
+  ls_string *cur = &ls->flat[0];
+  ls_string_clear(cur);
+  bool ok = ls_bin_to_string(b, cur);
+  ls_bin_free(b);
+  if (!ok) {
+    fprintf(stderr, "ls_resume: %s is corrupt\n", path);
+    return 0;
+  }
+
+  /* the generations before the checkpoint weren't derived here */
+  ls->seed = h.seed;
+  ls->generation = h.generation;
+  ls->generation_bytes.assign(h.generation, 0);
+  ls->generation_bytes.push_back(ls_string_bytes(cur));
+  return derive(ls, n, path, k, "ls_resume");
+}
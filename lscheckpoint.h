@@ -0,0 +1,37 @@
+#ifndef LSCHECKPOINT_H
+#define LSCHECKPOINT_H
+
+#include "lsystems.h"
+
+/* checkpoints of a flat derivation. the draws depend on nothing but the
+   seed, the generation and the string, so a checkpoint holding those
+   three resumes to the same string an uninterrupted run would have made.
+   the file is
+
+     "LSYSCKP" 0, u32 version, u32 generation, u64 seed, u64 grammar hash
+
+   followed by the string in the lsbin format. it is written to path.tmp
+   and renamed over path, so a run killed while saving leaves the last
+   checkpoint as it was */
+
+#define LS_CHECKPOINT_VERSION 1
+
+/* a hash of the definition as it was parsed, names by their text, so
+   it is the same in every process that loads the same grammar */
+unsigned long long ls_grammar_hash(lsystem *ls);
+
+/* save s as generation ls->generation, waiting until it's written */
+bool ls_checkpoint(lsystem *ls, const ls_string *s, const char *path);
+
+/* ls_run_flat, saving every kth generation to path on a thread of its
+   own. a save runs while the next generation is derived, and is waited
+   for only when its string would be overwritten */
+ls_string *ls_run_checkpointed(lsystem *ls, int n, const char *path, int k);
+
+/* continue from the checkpoint at path to generation n, saving as
+   ls_run_checkpointed does if k > 0. the checkpoint's seed replaces
+   ls->seed. 0 if the checkpoint can't be read or is of another grammar,
+   and for either, if the derivation goes over ls->memory_limit */
+ls_string *ls_resume(lsystem *ls, int n, const char *path, int k);
+
+#endif
@@ -0,0 +1,78 @@
+#include "lscompiled.h"
+#include "lscheckpoint.h"
+#include <dlfcn.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+bool ls_use_compiled(lsystem *ls, const char *library) {
+  std::string path = library;
+  if (!strchr(library, '/'))
+    path = "./" + path;		/* dlopen would search the library path */
+
+  void *lib = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+  if (!lib) {
+    fprintf(stderr, "ls_use_compiled: %s\n", dlerror());
+    return false;
+  }
+
+  const int *version = (const int *) dlsym(lib, "lsc_version");
+  const unsigned long long *hash =
+    (const unsigned long long *) dlsym(lib, "lsc_grammar_hash");
+  const int *nsymbols = (const int *) dlsym(lib, "lsc_nsymbols");
+  const char *const *symbols = (const char *const *) dlsym(lib, "lsc_symbols");
+  ls_compiled_apply *apply = (ls_compiled_apply *) dlsym(lib, "lsc_apply");
+
+  if (!version || !hash || !nsymbols || !symbols || !apply
+      || *version != LS_COMPILED_VERSION) {
+    fprintf(stderr, "ls_use_compiled: %s is not a rewriter of version %d\n",
+	    library, LS_COMPILED_VERSION);
+    dlclose(lib);
+    return false;
+  }
+  if (*hash != ls_grammar_hash(ls)) {
+    fprintf(stderr, "ls_use_compiled: %s was compiled from another grammar\n",
+	    library);
+    dlclose(lib);
+    return false;
+  }
+
+  ls_compiled *c = new ls_compiled;
+  c->library = lib;
+  c->apply = apply;
+  for (int k = 0; k < *nsymbols; k++) {
+    int sym = sxp_intern(symbols[k]);
+    c->symbol.push_back(sym);
+    if (sym >= (int) c->local.size())
+      c->local.resize(sym + 1, -1);
+    c->local[sym] = k;
+  }
+
+  ls_drop_compiled(ls);
+  ls->compiled = c;
+  return true;
+}
+
+void ls_drop_compiled(lsystem *ls) {
+  if (!ls->compiled)
+    return;
+  dlclose(ls->compiled->library);
+  delete ls->compiled;
+  ls->compiled = 0;
+}
+
+void ls_apply_compiled(lsystem *ls, const ls_string *in, ls_string *out) {
+  ls_compiled *c = ls->compiled;
+  ls_compiled_args a;
+  a.in = in;
+  a.out = out;
+  a.brackets = ls->has_context && !ls->brackets.empty() ? &ls->brackets[0] : 0;
+  a.local = c->local.empty() ? 0 : &c->local[0];
+  a.nlocal = c->local.size();
+  a.symbol = c->symbol.empty() ? 0 : &c->symbol[0];
+  a.seed = ls->seed;
+  a.generation = ls->generation;
+
+  ls_string_clear(out);
+  c->apply(&a);
+}
@@ -0,0 +1,64 @@
+#ifndef LSCOMPILED_H
+#define LSCOMPILED_H
+
+#include "lsstring.h"
+#include <vector>
+
+/* rewriters compiled ahead of time for one grammar by lsc (see lsc.cc),
+   built into a shared library and loaded into an lsystem of the same
+   grammar with ls_use_compiled. ls_apply_flat then rewrites each
+   generation with the library instead of matching productions, so
+   ls_run_flat, ls_step_flat and everything built on them derive the same
+   strings faster. the compiled rewriter runs on the calling thread, and
+   doesn't count into the production profiles.
+
+   the library and this header have to agree on ls_string and the
+   arguments below; LS_COMPILED_VERSION changes whenever they do. symbol
+   ids are numbered as each process interns them, so the library numbers
+   its symbols itself and is handed the mapping both ways */
+
+#define LS_COMPILED_VERSION 1
+
+typedef struct t_ls_compiled_args {
+  const ls_string *in;
+  ls_string *out;		/* empty; the generation is appended */
+  const int *brackets;		/* of in, see ls_index_brackets; 0 when no
+				   production has context */
+  const int *local;		/* symbol id -> the library's number, -1 */
+  int nlocal;
+  const int *symbol;		/* the library's number -> symbol id */
+  unsigned long long seed;
+  int generation;		/* of in */
+} ls_compiled_args;
+
+typedef void ls_compiled_apply(const ls_compiled_args *a);
+
+/* what the library exports, with c linkage:
+
+     const int lsc_version;			LS_COMPILED_VERSION
+     const unsigned long long lsc_grammar_hash;	see ls_grammar_hash
+     const int lsc_nsymbols;
+     const char *const lsc_symbols[];		names of its numbers
+     void lsc_apply(const ls_compiled_args *a); */
+
+typedef struct t_ls_compiled {
+  void *library;
+  ls_compiled_apply *apply;
+  std::vector<int> local;
+  std::vector<int> symbol;
+} ls_compiled;
+
+struct t_lsystem;
+
+/* load the rewriter in library into ls, replacing any it had; false,
+   leaving ls as it was, if the library can't be loaded or was compiled
+   from another grammar. a library without a / is looked for in the
+   current directory */
+bool ls_use_compiled(struct t_lsystem *ls, const char *library);
+void ls_drop_compiled(struct t_lsystem *ls);
+
+/* rewrite in into out with ls->compiled; for ls_apply_flat */
+void ls_apply_compiled(struct t_lsystem *ls, const ls_string *in,
+		       ls_string *out);
+
+#endif
@@ -0,0 +1,264 @@
+#include "lsdag.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+bool ls_memoizable(lsystem *ls) {
+  if (!ls_context_free(ls))
+    return false;
+
+  /* a stochastic choice depends on where the module is */
+  for (int i = 0; i < ls->productions.size(); i++) {
+    std::vector<double> &sum = ls->productions[i]->cumulative;
+    if (!ls->productions[i]->dead && (sum.size() != 1 || sum[0] < 1))
+      return false;
+  } return true;
+}
+
+/* nodes */
+
+static int new_node(ls_dag *d, int module) {
+  d->leaf.push_back(module);
+  d->first.push_back(d->first.back());
+  d->length.push_back(module < 0 ? 0 : 1);
+  return d->leaf.size() - 1;
+}
+
+static int new_inner(ls_dag *d, std::vector<int> &children) {
+  int k = new_node(d, -1);
+  for (int i = 0; i < children.size(); i++) {
+    d->child.push_back(children[i]);
+    d->length[k] += d->length[children[i]];
+  } d->first[k + 1] = d->child.size();
+  return k;
+}
+
+/* hash consing of modules. parameters compare by their bits, so the
+   table agrees with the hash on -0.0 and nan */
+
+static unsigned int module_hashfn(const ls_string *s, int i) {
+  unsigned int h = 2166136261u;
+  h = (h ^ (unsigned int) s->symbol[i]) * 16777619u;
+  for (unsigned int k = s->start[i]; k < s->start[i + 1]; k++) {
+    unsigned char bits[sizeof(double)];
+    memcpy(bits, &s->value[k], sizeof(double));
+    for (int j = 0; j < sizeof(double); j++)
+      h = (h ^ bits[j]) * 16777619u;
+    h = (h ^ s->type[k]) * 16777619u;
+  } return h;
+}
+
+static bool module_equal(const ls_string *a, int i, const ls_string *b, int j) {
+  int n = ls_nparams(a, i);
+  if (a->symbol[i] != b->symbol[j] || n != ls_nparams(b, j))
+    return false;
+  if (n == 0)
+    return true;
+  return !memcmp(&a->value[a->start[i]], &b->value[b->start[j]],
+		 n * sizeof(double))
+    && !memcmp(&a->type[a->start[i]], &b->type[b->start[j]], n);
+}
+
+static void module_rehash(ls_dag *d, int size) {
+  d->module_hash.assign(size, 0);
+  for (int k = 0; k < d->leaf.size(); k++) {
+    if (d->leaf[k] < 0)
+      continue;
+    unsigned int h = module_hashfn(&d->modules, d->leaf[k]) & (size - 1);
+    while (d->module_hash[h])
+      h = (h + 1) & (size - 1);
+    d->module_hash[h] = k + 1;
+  }
+}
+
+/* the leaf node for module i of s, added if it is new */
+static int intern_module(ls_dag *d, const ls_string *s, int i) {
+  int size = d->module_hash.size(), k;
+  if (2 * (ls_length(&d->modules) + 1) > size)
+    module_rehash(d, size = size ? 2 * size : 256);
+
+  unsigned int h = module_hashfn(s, i) & (size - 1);
+  while ((k = d->module_hash[h])) {
+    if (module_equal(&d->modules, d->leaf[k - 1], s, i))
+      return k - 1;
+    h = (h + 1) & (size - 1);
+  }
+
+  ls_push_copy(&d->modules, s, i);
+  k = new_node(d, ls_length(&d->modules) - 1);
+  d->module_hash[h] = k + 1;
+  return k;
+}
+
+/* the memo table, (leaf node, generations) -> node */
+
+static unsigned int memo_hashfn(int node, int depth) {
+  unsigned int h = 2166136261u;
+  h = (h ^ (unsigned int) node) * 16777619u;
+  return (h ^ (unsigned int) depth) * 16777619u;
+}
+
+static void memo_rehash(ls_dag *d, int size) {
+  d->memo_hash.assign(size, 0);
+  for (int e = 0; e < d->memo_node.size(); e++) {
+    unsigned int h = memo_hashfn(d->memo_node[e], d->memo_depth[e]) & (size - 1);
+    while (d->memo_hash[h])
+      h = (h + 1) & (size - 1);
+    d->memo_hash[h] = e + 1;
+  }
+}
+
+/* the slot where (node, depth) is or would go */
+static int *memo_find(ls_dag *d, int node, int depth) {
+  int size = d->memo_hash.size(), e;
+  if (2 * (d->memo_node.size() + 1) > size)
+    memo_rehash(d, size = size ? 2 * size : 256);
+
+  unsigned int h = memo_hashfn(node, depth) & (size - 1);
+  while ((e = d->memo_hash[h])) {
+    if (d->memo_node[e - 1] == node && d->memo_depth[e - 1] == depth)
+      break;
+    h = (h + 1) & (size - 1);
+  } return &d->memo_hash[h];
+}
+
+/* derivation */
+
+typedef struct t_builder {
+  lsystem *ls;
+  ls_dag *d;
+  env frame;
+  std::vector<ls_string> level;	/* expansion being walked per depth */
+  std::vector<std::vector<int> > children; /* its nodes, per depth */
+} builder;
+
+/* the node leaf becomes after depth more generations */
+static int expand(builder *b, int leaf, int depth) {
+  ls_dag *d = b->d;
+  if (depth == 0)
+    return leaf;
+
+  int *slot = memo_find(d, leaf, depth);
+  if (*slot) {
+    d->hits++;
+    return d->memo_result[*slot - 1];
+  } d->misses++;
+
+  int result = leaf;		/* nothing applies; the module stays */
+  production *p = ls_match_flat(b->ls, &d->modules, d->leaf[leaf], &b->frame);
+  if (p) {
+    stochastic_expansion *x = ls_select_expansion(b->ls, p, 0);
+    ls_string *next = &b->level[depth];
+    std::vector<int> &nodes = b->children[depth];
+
+    ls_string_clear(next);
+    if (x)
+      ls_expand_flat(b->ls, x, &b->frame, next);
+    if (b->ls->reference_eval)
+      sxp_arena_reset(b->ls->scratch);
+
+    nodes.clear();
+    for (int k = 0; k < ls_length(next); k++)
+      nodes.push_back(expand(b, intern_module(d, next, k), depth - 1));
+    result = nodes.size() == 1 ? nodes[0] : new_inner(d, nodes);
+  }
+
+  /* the recursion may have grown the table, so look again */
+  slot = memo_find(d, leaf, depth);
+  *slot = d->memo_node.size() + 1;
+  d->memo_node.push_back(leaf);
+  d->memo_depth.push_back(depth);
+  d->memo_result.push_back(result);
+  return result;
+}
+
+ls_dag *ls_run_dag(lsystem *ls, int n) {
+  if (!ls_memoizable(ls)) {
+    fprintf(stderr, "ls_run_dag: only deterministic context free lsystems can be memoized\n");
+    return 0;
+  }
+
+  ls_dag *d = new ls_dag;
+  d->hits = d->misses = 0;
+  d->first.push_back(0);
+
+  builder b;
+  b.ls = ls;
+  b.d = d;
+  b.level.resize(n + 1);
+  b.children.resize(n + 1);
+
+  ls_string axiom;
+  if (!ls_from_sxp(&axiom, ls->axiom)) {
+    fprintf(stderr, "ls_run_dag: axiom does not fit a flat string\n");
+    exit(-1);
+  }
+
+  sxp_arena *old = sxp_set_arena(ls->scratch);
+  sxp_arena_reset(ls->scratch);
+  std::vector<int> roots;
+  for (int i = 0; i < ls_length(&axiom); i++)
+    roots.push_back(expand(&b, intern_module(d, &axiom, i), n));
+  sxp_set_arena(old);
+
+  d->root = new_inner(d, roots);
+  ls->generation = n;
+  return d;
+}
+
+void ls_dag_free(ls_dag *d) {
+  delete d;
+}
+
+size_t ls_dag_bytes(const ls_dag *d) {
+  return ls_string_bytes(&d->modules)
+    + d->leaf.size() * (sizeof(int) + sizeof(unsigned int)
+			+ sizeof(unsigned long long))
+    + d->child.size() * sizeof(int)
+    + d->memo_node.size() * 3 * sizeof(int)
+    + (d->module_hash.size() + d->memo_hash.size()) * sizeof(int);
+}
+
+/* output, by walking the dag from the root with an explicit stack */
+
+static void walk(const ls_dag *d, ls_string *out, ls_sink sink, void *ctx) {
+  std::vector<unsigned int> stack;	/* pairs of node, next child */
+
+  stack.push_back(d->root);
+  stack.push_back(d->first[d->root]);
+  while (!stack.empty()) {
+    int node = stack[stack.size() - 2];
+    unsigned int c = stack.back();
+
+    if (c == d->first[node + 1]) {
+      stack.resize(stack.size() - 2);
+      continue;
+    }
+    stack.back()++;
+
+    int k = d->child[c];
+    if (d->leaf[k] < 0) {
+      stack.push_back(k);
+      stack.push_back(d->first[k]);
+      continue;
+    }
+
+    ls_push_copy(out, &d->modules, d->leaf[k]);
+    if (sink && ls_length(out) >= LS_STREAM_BATCH) {
+      sink(ctx, out);
+      ls_string_clear(out);
+    }
+  }
+
+  if (sink && ls_length(out))
+    sink(ctx, out);
+}
+
+void ls_dag_flatten(const ls_dag *d, ls_string *out) {
+  walk(d, out, 0, 0);
+}
+
+void ls_dag_stream(const ls_dag *d, ls_sink sink, void *ctx) {
+  ls_string out;
+  walk(d, &out, sink, ctx);
+}
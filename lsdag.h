@@ -0,0 +1,44 @@
+#ifndef LSDAG_H
+#define LSDAG_H
+
+#include "lsystems.h"
+#include "lsstream.h"
+
+/* derivation by memoized expansion, for lsystems that are context free
+   and deterministic. there what a module becomes after k generations
+   depends on the module and k alone, so each (module, k) is expanded
+   once and the result shared by every occurrence. the result is a dag:
+   node k is either a leaf, one module, or the concatenation of its
+   children. for self similar grammars such as F -> F F, nodes and work
+   grow linearly with the generation count while the string grows
+   exponentially */
+
+typedef struct t_ls_dag {
+  ls_string modules;		/* each distinct module once */
+  std::vector<int> leaf;	/* node -> its module, -1 for inner nodes */
+  std::vector<unsigned int> first; /* children of node k are child[first[k]]
+				      .. child[first[k+1]-1] */
+  std::vector<int> child;
+  std::vector<unsigned long long> length; /* modules node k expands to */
+  int root;			/* the whole generation */
+
+  /* memo table statistics for the derivation that built the dag */
+  unsigned long long hits, misses;
+
+  /* hash consing, open addressing tables holding index+1, 0 if empty */
+  std::vector<int> module_hash;	/* -> leaf node */
+  std::vector<int> memo_hash;	/* -> memo entry */
+  std::vector<int> memo_node, memo_depth, memo_result;
+} ls_dag;
+
+bool ls_memoizable(lsystem *ls);
+ls_dag *ls_run_dag(lsystem *ls, int n);
+void ls_dag_free(ls_dag *d);
+size_t ls_dag_bytes(const ls_dag *d);
+
+/* the string a dag stands for, appended to out or handed to a sink in
+   pieces as ls_stream does */
+void ls_dag_flatten(const ls_dag *d, ls_string *out);
+void ls_dag_stream(const ls_dag *d, ls_sink sink, void *ctx);
+
+#endif
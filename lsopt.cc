@@ -0,0 +1,226 @@
+#include "lsopt.h"
+#include <math.h>
+
+static bool constant(sxp *a, double *v) {
+  switch (a->type) {
+  case ty_integer:
+    *v = a->Z;
+    return true;
+  case ty_float:
+    *v = a->R;
+    return true;
+  } return false;
+}
+
+static bool is_param(production *p, sxp *a) {
+  if (a->type != ty_symbol)
+    return false;
+  for (int i = 0; i < p->params.size(); i++)
+    if (p->params[i] == a->sym)
+      return true;
+  return false;
+}
+
+static bool is_operator(sxp *a) {
+  return a && a->type == ty_symbol && ls_operator(a->sym) != op_none;
+}
+
+/* an operand holding an operator expression, which evaluates to a float */
+static bool is_expression(sxp *a) {
+  return a->type == ty_sxp && is_operator(a->down);
+}
+
+static sxp *value(production *p, double v) {
+  p->folded++;
+  return sxp_makefloat(v, 0);
+}
+
+static sxp *link(std::vector<sxp *> &nodes) {
+  for (int i = 0; i + 1 < nodes.size(); i++)
+    nodes[i]->next = nodes[i + 1];
+  return nodes.empty() ? 0 : nodes[0];
+}
+
+/* operands that leave a running result as it was: r + 0, r * 1, and
+   r - 0 and r / 1 after the first. -0 is only an identity for +, whose
+   result starts at 0 and so is never -0 itself */
+static bool identity(int op, sxp *a) {
+  double v;
+  if (!constant(a, &v))
+    return false;
+  switch (op) {
+  case op_add:
+    return v == 0;
+  case op_sub:
+    return v == 0 && !signbit(v);
+  case op_mul:
+  case op_div:
+    return v == 1;
+  } return false;
+}
+
+static sxp *fold_module(production *p, sxp *m);
+
+/* folds are built from fresh nodes; lists they leave alone are shared
+   with the definition, which is never changed */
+static sxp *fold_expression(production *p, sxp *expr, bool reduce);
+
+static sxp *fold_operand(production *p, sxp *a) {
+  if (is_expression(a))
+    return fold_expression(p, a->down, true);
+
+  switch (a->type) {
+  case ty_integer:
+    return sxp_makeint(a->Z, 0);
+  case ty_float:
+    return sxp_makefloat(a->R, 0);
+  case ty_symbol:
+    return sxp_makesym(a->sym, 0);
+  }
+  if (a->down && a->down->type == ty_symbol)
+    return sxp_makesxp(fold_module(p, a->down), 0);
+  return sxp_makesxp(a->down, 0);
+}
+
+/* expr is (op operands...); the result is an operand standing for it:
+   its value if it folds, or the list of the simplified expression. with
+   reduce, an operation left with one operand that already is a float
+   may become that operand */
+static sxp *fold_expression(production *p, sxp *expr, bool reduce) {
+  int op = ls_operator(expr->sym);
+  std::vector<sxp *> args, kept;
+  for (sxp *a = expr->next; a; a = a->next)
+    args.push_back(fold_operand(p, a));
+  int n = args.size();
+  double x, y;
+
+  switch (op) {
+  case op_add:
+  case op_mul:
+  case op_sub:
+  case op_div: {
+    bool first = op == op_sub || op == op_div;
+    if (first && n == 0)
+      return value(p, 0);
+
+    /* the leading constants, in the evaluator's order */
+    double r = op == op_mul ? 1 : 0;
+    int i = 0;
+    for (; i < n && constant(args[i], &x); i++) {
+      if (first && i == 0)
+	r = x;
+      else
+	r = op == op_add ? r + x : op == op_mul ? r * x
+	  : op == op_sub ? r - x : r / x;
+    }
+    if (i == n)
+      return value(p, r);
+
+    /* the first operand of - and / is never an identity */
+    if (i > 1)
+      kept.push_back(value(p, r));
+    else
+      i = 0;
+    if (first && kept.empty())
+      kept.push_back(args[i++]);
+    for (; i < n; i++) {
+      if (identity(op, args[i]))
+	p->simplified++;
+      else
+	kept.push_back(args[i]);
+    }
+
+    if (reduce && op != op_add && kept.size() == 1
+	&& (is_param(p, kept[0]) || is_expression(kept[0]))) {
+      p->simplified++;
+      return kept[0];
+    } break;
+  }
+
+  case op_eq:
+  case op_lt:
+  case op_gt:
+  case op_lte:
+  case op_gte:
+    kept = args;
+    if (n != 2 || !constant(args[0], &x) || !constant(args[1], &y))
+      break;
+    switch (op) {
+    case op_eq:
+      return value(p, x == y ? 1 : 0);
+    case op_lt:
+      return value(p, x < y ? 1 : 0);
+    case op_gt:
+      return value(p, x > y ? 1 : 0);
+    case op_lte:
+      return value(p, x <= y ? 1 : 0);
+    } return value(p, x >= y ? 1 : 0);
+
+  case op_not:
+    kept = args;
+    if (n == 1 && constant(args[0], &x))
+      return value(p, x == 0 ? 1 : 0);
+    break;
+
+  case op_and:
+  case op_or:
+    /* a constant either short circuits, deciding the whole, or can't
+       and is dropped; the compiled program treats them that way */
+    for (int i = 0; i < n; i++) {
+      if (!constant(args[i], &x))
+	kept.push_back(args[i]);
+      else if (op == op_and ? x == 0 : x == 1)
+	return value(p, op == op_and ? 0 : 1);
+      else
+	p->simplified++;
+    }
+    if (kept.empty())
+      return value(p, op == op_and ? 1 : 0);
+    break;
+  }
+
+  return sxp_makesxp(sxp_makesym(expr->sym, link(kept)), 0);
+}
+
+/* (A args...) of an expansion */
+static sxp *fold_module(production *p, sxp *m) {
+  std::vector<sxp *> args;
+  for (sxp *a = m->next; a; a = a->next)
+    args.push_back(fold_operand(p, a));
+  return sxp_makesym(m->sym, link(args));
+}
+
+/* an expansion, or a branch of one: a list of modules and branches */
+static sxp *fold_list(production *p, sxp *list) {
+  std::vector<sxp *> elements;
+  for (sxp *r = list; r; r = r->next) {
+    sxp *d = r->down;
+    if (r->type != ty_sxp || !d || is_operator(d))
+      elements.push_back(r->type == ty_sxp ? sxp_makesxp(d, 0)
+			 : fold_operand(p, r));
+    else if (d->type == ty_symbol)
+      elements.push_back(sxp_makesxp(fold_module(p, d), 0));
+    else
+      elements.push_back(sxp_makesxp(fold_list(p, d), 0));
+  } return link(elements);
+}
+
+void ls_optimize(production *p) {
+  p->folded = p->simplified = 0;
+  p->dead = p->unconditional = false;
+
+  if (is_operator(p->condition)) {
+    sxp *c = fold_expression(p, p->condition, false);
+    double v;
+    if (!constant(c, &v))
+      p->condition = c->down;
+    else if (v > 0) {
+      p->unconditional = true;
+      p->condition = 0;
+    } else
+      p->dead = true;		/* never tested; it keeps its condition */
+  }
+
+  for (int k = 0; k < p->expansion.size(); k++)
+    p->expansion[k]->expansion = fold_list(p, p->expansion[k]->expansion);
+}
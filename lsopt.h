@@ -0,0 +1,29 @@
+#ifndef LSOPT_H
+#define LSOPT_H
+
+#include "lsystems.h"
+
+/* the loader's optimization pass over a production's condition and
+   expansions, run by parse_production before they are compiled. it
+   rewrites them with new nodes in the current arena and leaves the
+   definition as it was parsed, so the grammar hash doesn't change.
+
+   every rewrite gives the value the evaluator would have, to the bit:
+
+     - an operator whose operands are all constants becomes its value.
+       + - * / fold only their leading constants, since they evaluate
+       left to right and floating point doesn't reassociate
+     - + 0, * 1, and - 0 or / 1 after the first operand are dropped, as
+       are operands of and/or that can't short circuit. (* e), (- e) and
+       (/ e) become e when e is a parameter or an expression; (+ e)
+       stays, as 0 + -0 is not -0
+     - a condition that folds to a constant is decided: never true makes
+       the production dead, and ls_build_dispatch leaves it out; always
+       true drops the condition
+
+   expansion arguments that are computed the same way more than once are
+   shared when the expansion is compiled (see vm_compile_expansion).
+   dump_optimization reports what was done to each production */
+void ls_optimize(production *p);
+
+#endif
@@ -0,0 +1,219 @@
+#include "lsparallel.h"
+#include "lstrace.h"
+#include <pthread.h>
+#include <string.h>
+
+/* a piece of the string being rewritten in parallel */
+typedef struct t_chunk {
+  int begin, end;
+  ls_string out;
+  size_t module_base, param_base;
+} chunk;
+
+/* thread pool */
+
+struct t_ls_pool {
+  int nthreads;
+  pthread_t *threads;
+  std::vector<sxp_arena *> scratch;
+
+  /* ls_apply_parallel's buffers, kept for the next generation */
+  std::vector<chunk> chunks;
+
+  pthread_mutex_t lock;
+  pthread_cond_t work, done;
+  void (*fn)(void *, int, int);
+  void *ctx;
+  int ntasks, next, pending;
+  bool quit;
+};
+
+typedef struct t_worker {
+  ls_pool *pool;
+  int thread;
+} worker;
+
+static void run_task(ls_pool *pool, int task, int thread) {
+  sxp_arena *old = sxp_set_arena(pool->scratch[thread]);
+  pool->fn(pool->ctx, task, thread);
+  sxp_set_arena(old);
+}
+
+/* take tasks until there are none left; called with the lock held */
+static void drain(ls_pool *pool, int thread) {
+  while (pool->next < pool->ntasks) {
+    int task = pool->next++;
+    pthread_mutex_unlock(&pool->lock);
+    run_task(pool, task, thread);
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->pending == 0)
+      pthread_cond_broadcast(&pool->done);
+  }
+}
+
+static void *worker_main(void *arg) {
+  worker *w = (worker *) arg;
+  ls_pool *pool = w->pool;
+
+  pthread_mutex_lock(&pool->lock);
+  while (!pool->quit) {
+    drain(pool, w->thread);
+    if (!pool->quit)
+      pthread_cond_wait(&pool->work, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  delete w;
+  return 0;
+}
+
+ls_pool *ls_pool_new(int threads) {
+  ls_pool *pool = new ls_pool;
+  pool->nthreads = threads < 1 ? 1 : threads;
+  pool->ntasks = pool->next = pool->pending = 0;
+  pool->quit = false;
+  pthread_mutex_init(&pool->lock, 0);
+  pthread_cond_init(&pool->work, 0);
+  pthread_cond_init(&pool->done, 0);
+
+  for (int i = 0; i < pool->nthreads; i++)
+    pool->scratch.push_back(sxp_arena_new());
+
+  /* the caller of ls_pool_run is thread 0 */
+  pool->threads = new pthread_t[pool->nthreads];
+  for (int i = 1; i < pool->nthreads; i++) {
+    worker *w = new worker;
+    w->pool = pool;
+    w->thread = i;
+    pthread_create(&pool->threads[i], 0, worker_main, w);
+  } return pool;
+}
+
+void ls_pool_free(ls_pool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->quit = true;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (int i = 1; i < pool->nthreads; i++)
+    pthread_join(pool->threads[i], 0);
+  for (int i = 0; i < pool->nthreads; i++)
+    sxp_arena_free(pool->scratch[i]);
+
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->work);
+  pthread_cond_destroy(&pool->done);
+  delete[] pool->threads;
+  delete pool;
+}
+
+int ls_pool_threads(ls_pool *pool) {
+  return pool->nthreads;
+}
+
+void ls_pool_run(ls_pool *pool, int tasks,
+		 void (*fn)(void *ctx, int task, int thread), void *ctx) {
+  for (int i = 0; i < pool->nthreads; i++)
+    sxp_arena_reset(pool->scratch[i]);
+
+  pthread_mutex_lock(&pool->lock);
+  pool->fn = fn;
+  pool->ctx = ctx;
+  pool->ntasks = tasks;
+  pool->next = 0;
+  pool->pending = tasks;
+  pthread_cond_broadcast(&pool->work);
+
+  drain(pool, 0);
+  while (pool->pending)
+    pthread_cond_wait(&pool->done, &pool->lock);
+  pool->ntasks = pool->next = 0;
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/* parallel rewriting */
+
+typedef struct t_rewrite {
+  lsystem *ls;
+  const ls_string *in;
+  ls_string *out;
+  chunk *chunks;
+} rewrite;
+
+/* first pass: rewrite each chunk into its own string */
+static void rewrite_chunk(void *ctx, int task, int) {
+  rewrite *r = (rewrite *) ctx;
+  chunk *c = &r->chunks[task];
+  env frame, *e = &frame;
+  ls_span span;
+  ls_span_begin(&span, ls_trace_phases, "match chunk", "chunk", task);
+
+  ls_string_clear(&c->out);
+  for (int i = c->begin; i < c->end; i++) {
+    production *p = ls_match_flat(r->ls, r->in, i, e);
+    if (!p) {
+      ls_push_copy(&c->out, r->in, i);
+      continue;
+    }
+
+    stochastic_expansion *x = ls_select_expansion(r->ls, p, i);
+    if (x)
+      ls_expand_flat(r->ls, x, e, &c->out);
+  } ls_span_end(&span);
+}
+
+/* second pass: copy each chunk's output to its place in the result */
+static void stitch_chunk(void *ctx, int task, int) {
+  rewrite *r = (rewrite *) ctx;
+  chunk *c = &r->chunks[task];
+  ls_string *out = r->out;
+  int n = ls_length(&c->out);
+  size_t np = c->out.value.size();
+  ls_span span;
+  ls_span_begin(&span, ls_trace_phases, "stitch chunk", "chunk", task);
+
+  if (n)
+    memcpy(&out->symbol[c->module_base], &c->out.symbol[0], n * sizeof(int));
+  for (int i = 0; i < n; i++)
+    out->start[c->module_base + i] = c->out.start[i] + c->param_base;
+  if (np) {
+    memcpy(&out->value[c->param_base], &c->out.value[0], np * sizeof(double));
+    memcpy(&out->type[c->param_base], &c->out.type[0], np);
+  } ls_span_end(&span);
+}
+
+void ls_apply_parallel(lsystem *ls, const ls_string *in, ls_string *out,
+		       ls_pool *pool) {
+  rewrite r;
+  int n = ls_length(in);
+  int nchunks = ls_pool_threads(pool) * 8;
+  int size = (n + nchunks - 1) / nchunks;
+
+  pool->chunks.resize(nchunks);
+  r.ls = ls;
+  r.in = in;
+  r.out = out;
+  r.chunks = &pool->chunks[0];
+  for (int i = 0; i < nchunks; i++) {
+    r.chunks[i].begin = i * size < n ? i * size : n;
+    r.chunks[i].end = (i + 1) * size < n ? (i + 1) * size : n;
+  }
+
+  ls_pool_run(pool, nchunks, rewrite_chunk, &r);
+
+  /* prefix sums over the chunk lengths place every chunk */
+  size_t modules = 0, params = 0;
+  for (int i = 0; i < nchunks; i++) {
+    r.chunks[i].module_base = modules;
+    r.chunks[i].param_base = params;
+    modules += ls_length(&r.chunks[i].out);
+    params += r.chunks[i].out.value.size();
+  }
+
+  out->symbol.resize(modules);
+  out->start.resize(modules + 1);
+  out->start[modules] = params;
+  out->value.resize(params);
+  out->type.resize(params);
+  ls_pool_run(pool, nchunks, stitch_chunk, &r);
+}
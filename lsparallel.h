@@ -0,0 +1,28 @@
+#ifndef LSPARALLEL_H
+#define LSPARALLEL_H
+
+#include "lsystems.h"
+
+/* a fixed set of worker threads. ls_pool_run hands out tasks 0..n-1 to
+   the workers and the calling thread, and returns once all are done.
+   each thread has a scratch arena selected while it runs a task */
+typedef struct t_ls_pool ls_pool;
+
+ls_pool *ls_pool_new(int threads);
+void ls_pool_free(ls_pool *pool);
+int ls_pool_threads(ls_pool *pool);
+void ls_pool_run(ls_pool *pool, int tasks,
+		 void (*fn)(void *ctx, int task, int thread), void *ctx);
+
+/* strings shorter than this are not worth splitting */
+#define LS_PARALLEL_MIN 8192
+
+/* ls_apply_flat over a pool. every module is rewritten independently of
+   the others, reading its context straight from in, so the string is cut
+   into chunks that are matched and expanded in parallel. random draws
+   are keyed by module position, so the result is identical to the
+   sequential rewriter for any thread count */
+void ls_apply_parallel(lsystem *ls, const ls_string *in, ls_string *out,
+		       ls_pool *pool);
+
+#endif
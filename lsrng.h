@@ -0,0 +1,45 @@
+#ifndef LSRNG_H
+#define LSRNG_H
+
+/* counter based random numbers (philox4x32-10, Salmon et al. 2011).
+   a draw is a pure function of its key and counter, so the choice made
+   for any module can be computed on its own, in any order and on any
+   thread, without a generator state to carry between draws */
+
+typedef unsigned int ls_u32;
+typedef unsigned long long ls_u64;
+
+static inline void ls_philox_round(ls_u32 c[4], const ls_u32 k[2]) {
+  ls_u64 p0 = (ls_u64) 0xD2511F53 * c[0];
+  ls_u64 p1 = (ls_u64) 0xCD9E8D57 * c[2];
+  ls_u32 c1 = c[1], c3 = c[3];
+
+  c[0] = (ls_u32) (p1 >> 32) ^ c1 ^ k[0];
+  c[1] = (ls_u32) p1;
+  c[2] = (ls_u32) (p0 >> 32) ^ c3 ^ k[1];
+  c[3] = (ls_u32) p0;
+}
+
+/* encrypt counter c in place under key k */
+static inline void ls_philox(ls_u32 c[4], const ls_u32 key[2]) {
+  ls_u32 k[2] = {key[0], key[1]};
+  for (int i = 0; i < 10; i++) {
+    if (i) {
+      k[0] += 0x9E3779B9;
+      k[1] += 0xBB67AE85;
+    } ls_philox_round(c, k);
+  }
+}
+
+/* uniform in [0, 1) with 53 random bits, for module position of
+   generation under seed */
+static inline double ls_rng_uniform(ls_u64 seed, ls_u32 generation,
+				    ls_u32 position) {
+  ls_u32 k[2] = {(ls_u32) seed, (ls_u32) (seed >> 32)};
+  ls_u32 c[4] = {position, generation, 0, 0};
+  ls_philox(c, k);
+  ls_u64 bits = ((ls_u64) c[0] << 32 | c[1]) >> 11;
+  return bits * (1.0 / 9007199254740992.0);
+}
+
+#endif
@@ -0,0 +1,380 @@
+#include "lsrope.h"
+#include "lstrace.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+static bool active(lsystem *ls, int sym) {
+  return sym >= 0 && sym < ls->rewritable.size() && ls->rewritable[sym];
+}
+
+static unsigned int piece_length(const ls_piece &p) {
+  return p.end - p.begin;
+}
+
+/* add inert modules begin..end-1 of buffer b. into is the buffer of the
+   generation being built, -1 while there is none.
+
+   an inert run that grows a little every generation would otherwise
+   become one piece per generation. so, like the digits of a binary
+   counter, the last two pieces of a run are joined while the earlier is
+   no more than twice as long, by copying them to the end of the new
+   buffer. a run stays O(log n) pieces, and each module is copied
+   O(log n) times over the whole derivation */
+static void add_inert(ls_rope *r, int b, unsigned int begin,
+		      unsigned int end, int into) {
+  std::vector<ls_piece> &pieces = r->next;
+  ls_piece p = {b, begin, end, false};
+  pieces.push_back(p);
+
+  while (pieces.size() >= 2) {
+    ls_piece &prev = pieces[pieces.size() - 2], &last = pieces.back();
+    if (prev.active)
+      break;
+    if (prev.buffer == last.buffer && prev.end == last.begin) {
+      prev.end = last.end;
+      pieces.pop_back();
+      continue;
+    }
+    if (into < 0 || piece_length(prev) > 2 * piece_length(last))
+      break;
+
+    ls_string *out = r->buffers[into];
+    unsigned int at = ls_length(out);
+    if (prev.buffer == into && prev.end == at)
+      at = prev.begin;		/* already at the end, leave it there */
+    else {
+      for (unsigned int i = prev.begin; i < prev.end; i++)
+	ls_push_copy(out, r->buffers[prev.buffer], i);
+    }
+    for (unsigned int i = last.begin; i < last.end; i++)
+      ls_push_copy(out, r->buffers[last.buffer], i);
+
+    prev.buffer = into;
+    prev.begin = at;
+    prev.end = ls_length(out);
+    pieces.pop_back();
+  }
+}
+
+/* add modules begin..end-1 of buffer b, each active one a piece */
+static void add_span(lsystem *ls, ls_rope *r, int b, unsigned int begin,
+		     unsigned int end, int into) {
+  unsigned int i = begin;
+  while (i < end) {
+    if (active(ls, r->buffers[b]->symbol[i])) {
+      ls_piece p = {b, i, i + 1, true};
+      r->next.push_back(p);
+      ++i;
+      continue;
+    }
+
+    unsigned int j = i + 1;
+    while (j < end && !active(ls, r->buffers[b]->symbol[j]))
+      ++j;
+    add_inert(r, b, i, j, into);
+    i = j;
+  }
+}
+
+static void index_brackets(const ls_string *s, ls_rope_brackets *b) {
+  int n = ls_length(s);
+  std::vector<int> stack;
+  b->depth.resize(n + 1);
+  b->open.resize(n);
+  b->close.resize(n);
+
+  b->depth[0] = 0;
+  for (int i = 0; i < n; i++) {
+    int sym = s->symbol[i];
+    b->depth[i + 1] = b->depth[i];
+    if (sym == LS_OPEN) {
+      ++b->depth[i + 1];
+      stack.push_back(i);
+    } else if (sym == LS_CLOSE) {
+      --b->depth[i + 1];
+      if (!stack.empty())
+	stack.pop_back();
+    } b->open[i] = stack.empty() ? -1 : stack.back();
+  }
+
+  stack.clear();
+  for (int i = n - 1; i >= 0; i--) {
+    int sym = s->symbol[i];
+    if (sym == LS_CLOSE)
+      stack.push_back(i);
+    else if (sym == LS_OPEN && !stack.empty())
+      stack.pop_back();
+    b->close[i] = stack.empty() ? -1 : stack.back();
+  }
+}
+
+static void finish(lsystem *ls, ls_rope *r) {
+  std::swap(r->pieces, r->next);
+  r->next.clear();
+
+  /* free the buffers that nothing is kept from */
+  std::vector<bool> used(r->buffers.size(), false);
+  r->length = 0;
+  for (int k = 0; k < r->pieces.size(); k++) {
+    used[r->pieces[k].buffer] = true;
+    r->length += r->pieces[k].end - r->pieces[k].begin;
+  }
+
+  for (int b = 0; b < r->buffers.size(); b++) {
+    if (!used[b] && r->buffers[b]) {
+      delete r->buffers[b];
+      delete r->brackets[b];
+      r->buffers[b] = 0;
+      r->brackets[b] = 0;
+      r->unused.push_back(b);
+    } else if (used[b] && !r->brackets[b] && ls->has_context) {
+      /* the buffer of the generation just built. only context walks
+	 use the brackets */
+      r->brackets[b] = new ls_rope_brackets;
+      index_brackets(r->buffers[b], r->brackets[b]);
+    }
+  }
+}
+
+ls_rope *ls_rope_new(lsystem *ls) {
+  ls_rope *r = new ls_rope;
+  ls_string *axiom = new ls_string;
+  if (!ls_from_sxp(axiom, ls->axiom)) {
+    fprintf(stderr, "ls_rope_new: axiom does not fit a flat string\n");
+    exit(-1);
+  }
+
+  r->buffers.push_back(axiom);
+  r->brackets.push_back(0);
+  add_span(ls, r, 0, 0, ls_length(axiom), -1);
+  finish(ls, r);
+  return r;
+}
+
+void ls_rope_free(ls_rope *r) {
+  for (int b = 0; b < r->buffers.size(); b++) {
+    delete r->buffers[b];
+    delete r->brackets[b];
+  } delete r;
+}
+
+/* context. a cursor walks the modules the pieces spell out, and the
+   neighbours follow the same rules as in lsystems.cc. a branch within a
+   piece is skipped in one step with the brackets of its buffer, and so
+   is the rest of a piece that doesn't close the branches being skipped,
+   so a walk costs the pieces and levels it crosses rather than the
+   modules */
+
+typedef struct t_cursor {
+  int piece;
+  unsigned int at;		/* index in the piece's buffer */
+} cursor;
+
+static const ls_string *buffer_of(const ls_rope *r, const cursor *c) {
+  return r->buffers[r->pieces[c->piece].buffer];
+}
+
+static int symbol_at(const ls_rope *r, const cursor *c) {
+  return buffer_of(r, c)->symbol[c->at];
+}
+
+static bool step_left(const ls_rope *r, cursor *c) {
+  while (c->at == r->pieces[c->piece].begin) {
+    if (--c->piece < 0)
+      return false;
+    c->at = r->pieces[c->piece].end;
+  }
+  --c->at;
+  return true;
+}
+
+static bool step_right(const ls_rope *r, cursor *c) {
+  ++c->at;
+  while (c->at == r->pieces[c->piece].end) {
+    if (++c->piece == r->pieces.size())
+      return false;
+    c->at = r->pieces[c->piece].begin;
+  } return true;
+}
+
+/* depth is the branches the walk is inside of and skipping */
+static bool left_neighbour(const ls_rope *r, cursor *c) {
+  int depth = 0;
+  while (step_left(r, c)) {
+    const ls_piece &p = r->pieces[c->piece];
+    const ls_rope_brackets *b = r->brackets[p.buffer];
+    int at = c->at, begin = p.begin;
+
+    if (depth > 0) {
+      /* to the open of the innermost, or past the piece's closes */
+      if (b->open[at] >= begin) {
+	c->at = b->open[at];
+	--depth;
+      } else {
+	depth += b->depth[begin] - b->depth[at + 1];
+	c->at = begin;
+      } continue;
+    }
+
+    int sym = symbol_at(r, c);
+    if (sym == LS_CLOSE) {
+      int open = at > begin ? b->open[at - 1] : -1;
+      if (open >= begin)
+	c->at = open;		/* a branch: go on before it */
+      else
+	depth = 1;
+    } else if (sym != LS_OPEN)
+      return true;		/* an open: on into the parent */
+  } return false;
+}
+
+static bool right_neighbour(const ls_rope *r, cursor *c) {
+  int depth = 0;
+  while (step_right(r, c)) {
+    const ls_piece &p = r->pieces[c->piece];
+    const ls_rope_brackets *b = r->brackets[p.buffer];
+    int at = c->at, end = p.end;
+
+    if (depth > 0) {
+      /* to the close of the innermost, or past the piece's opens */
+      if (b->close[at] >= 0 && b->close[at] < end) {
+	c->at = b->close[at];
+	--depth;
+      } else {
+	depth += b->depth[end] - b->depth[at];
+	c->at = end - 1;
+      } continue;
+    }
+
+    int sym = symbol_at(r, c);
+    if (sym == LS_OPEN) {
+      int close = at + 1 < end ? b->close[at + 1] : -1;
+      if (close >= 0 && close < end)
+	c->at = close;
+      else
+	depth = 1;
+    } else if (sym == LS_CLOSE)
+      return false;		/* the end of the branch */
+    else
+      return true;
+  } return false;
+}
+
+static bool attempt_match_rope(production *p, const ls_rope *r, cursor at,
+			       env *e) {
+  int nleft = p->left.size(), nright = p->right.size();
+  cursor j = at;
+  int k = nleft;
+  LS_COUNT(p, attempts, 1);
+
+  /* the left context, nearest first, on the walk back toward the root */
+  e->p = p;
+  e->bound = 0;
+  for (int n = nleft - 1; n >= 0; n--) {
+    if (!left_neighbour(r, &j)) {
+      LS_COUNT(p, symbol_rejects, 1);
+      return false;
+    }
+    if (!ls_match_params(e, p->left[n], &p->slots[n][0], buffer_of(r, &j), j.at))
+      return false;
+  }
+
+  if (!ls_match_params(e, p->center, &p->slots[k++][0], buffer_of(r, &at), at.at))
+    return false;
+
+  j = at;
+  for (int n = 0; n < nright; n++, k++) {
+    if (!right_neighbour(r, &j)) {
+      LS_COUNT(p, symbol_rejects, 1);
+      return false;
+    }
+    if (!ls_match_params(e, p->right[n], &p->slots[k][0], buffer_of(r, &j), j.at))
+      return false;
+  } return true;
+}
+
+void ls_apply_rope(lsystem *ls, ls_rope *r) {
+  env frame, *e = &frame;
+  ls_string *out = new ls_string;
+  int into;
+  ls_span span;
+  ls_span_begin(&span, ls_trace_phases, "generation", "generation",
+		ls->generation);
+  if (r->unused.empty()) {
+    into = r->buffers.size();
+    r->buffers.push_back(out);
+    r->brackets.push_back(0);
+  } else {
+    into = r->unused.back();
+    r->unused.pop_back();
+    r->buffers[into] = out;
+  }
+
+  /* the tree walker's temporaries go to the scratch arena */
+  sxp_arena *old = sxp_set_arena(ls->scratch);
+  sxp_arena_reset(ls->scratch);
+
+  unsigned int position = 0;
+  for (int k = 0; k < r->pieces.size(); k++) {
+    ls_piece p = r->pieces[k];
+    if (!p.active) {
+      add_inert(r, p.buffer, p.begin, p.end, into);
+      position += p.end - p.begin;
+      continue;
+    }
+
+    cursor at = {k, p.begin};
+    std::vector<production *> &candidates = ls->dispatch[symbol_at(r, &at)];
+    production *match = 0;
+    for (int j = 0; j < candidates.size() && !match; j++) {
+      if (attempt_match_rope(candidates[j], r, at, e)
+	  && ls_test_condition(ls, candidates[j], e))
+	match = candidates[j];
+    }
+
+    if (!match) {
+      r->next.push_back(p);
+      ++position;
+      continue;
+    }
+
+    stochastic_expansion *x = ls_select_expansion(ls, match, position++);
+    if (x) {
+      unsigned int begin = ls_length(out);
+      ls_expand_flat(ls, x, e, out);
+      add_span(ls, r, into, begin, ls_length(out), into);
+    }
+  }
+  sxp_set_arena(old);
+
+  finish(ls, r);
+  ++ls->generation;
+  ls_span_end(&span);
+}
+
+ls_rope *ls_run_rope(lsystem *ls, int n) {
+  ls_rope *r = ls_rope_new(ls);
+  ls->generation = 0;
+  for (int i = 0; i < n; i++)
+    ls_apply_rope(ls, r);
+  return r;
+}
+
+void ls_rope_flatten(const ls_rope *r, ls_string *out) {
+  for (int k = 0; k < r->pieces.size(); k++) {
+    const ls_piece &p = r->pieces[k];
+    for (unsigned int i = p.begin; i < p.end; i++)
+      ls_push_copy(out, r->buffers[p.buffer], i);
+  }
+}
+
+size_t ls_rope_bytes(const ls_rope *r) {
+  size_t bytes = r->pieces.capacity() * sizeof(ls_piece);
+  for (int b = 0; b < r->buffers.size(); b++) {
+    if (r->buffers[b])
+      bytes += ls_string_bytes(r->buffers[b]);
+    if (r->brackets[b])
+      bytes += (r->brackets[b]->depth.capacity() + r->brackets[b]->open.capacity()
+		+ r->brackets[b]->close.capacity()) * sizeof(int);
+  } return bytes;
+}
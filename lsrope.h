@@ -0,0 +1,56 @@
+#ifndef LSROPE_H
+#define LSROPE_H
+
+#include "lsystems.h"
+
+/* a derived string as a piece table over flat buffers. each generation
+   writes the expansions it makes to one new buffer; everything else is
+   kept by reference to the buffer it was written to. runs of modules no
+   production rewrites (brackets included) are single inert pieces, and
+   every module that some production could rewrite is a piece of its own,
+   so a rewrite looks only at the active pieces: in grammars where most
+   of the string is inert, a generation costs in proportion to the
+   modules that can change rather than to the length of the string.
+
+   the string the pieces spell out is the same as ls_run_flat's, draws
+   included. buffers no piece refers to any more are freed after each
+   generation */
+
+typedef struct t_ls_piece {
+  int buffer;
+  unsigned int begin, end;	/* modules begin .. end-1 of the buffer */
+  bool active;			/* one rewritable module */
+} ls_piece;
+
+/* the brackets of a buffer, for walking context across pieces without
+   looking at the modules of the branches it skips, as ls_index_brackets
+   does for a flat string. buffers needn't be balanced, as an inert piece
+   can hold part of a branch. depth[i] is opens less closes before
+   module i; open[i] is the innermost open at or before i that nothing up
+   to i closes, close[i] the innermost close at or after i that nothing
+   from i opens, -1 if there is none */
+typedef struct t_ls_rope_brackets {
+  std::vector<int> depth;
+  std::vector<int> open;
+  std::vector<int> close;
+} ls_rope_brackets;
+
+typedef struct t_ls_rope {
+  std::vector<ls_string *> buffers; /* 0 once freed */
+  std::vector<ls_rope_brackets *> brackets; /* of each buffer once it is
+					       complete, if the grammar
+					       has context */
+  std::vector<int> unused;	/* freed slots of buffers */
+  std::vector<ls_piece> pieces;
+  std::vector<ls_piece> next;	/* the next generation, while it's built */
+  size_t length;		/* modules in the string */
+} ls_rope;
+
+ls_rope *ls_rope_new(lsystem *ls);	/* the axiom */
+void ls_rope_free(ls_rope *r);
+void ls_apply_rope(lsystem *ls, ls_rope *r);
+ls_rope *ls_run_rope(lsystem *ls, int n);
+void ls_rope_flatten(const ls_rope *r, ls_string *out);
+size_t ls_rope_bytes(const ls_rope *r);
+
+#endif
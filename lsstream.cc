@@ -0,0 +1,98 @@
+#include "lsstream.h"
+#include "lstrace.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef struct t_stream {
+  lsystem *ls;
+  int n;
+  std::vector<ls_string> level;	/* the expansion being walked per level */
+  std::vector<unsigned int> position; /* next flat index per generation */
+  env frame;
+
+  ls_string out;		/* pending piece of generation n */
+  ls_sink sink;
+  void *ctx;
+} stream;
+
+bool ls_context_free(lsystem *ls) {
+  for (int i = 0; i < ls->productions.size(); i++) {
+    production *p = ls->productions[i];
+    if (!p->dead && (!p->left.empty() || !p->right.empty()))
+      return false;
+  } return true;
+}
+
+static void emit(stream *st, const ls_string *s, int i) {
+  ls_push_copy(&st->out, s, i);
+  if (ls_length(&st->out) >= LS_STREAM_BATCH) {
+    st->sink(st->ctx, &st->out);
+    ls_string_clear(&st->out);
+  }
+}
+
+/* module i of s, which is in generation g */
+static void derive(stream *st, const ls_string *s, int i, int g) {
+  lsystem *ls = st->ls;
+  env *e = &st->frame;
+  unsigned int position = st->position[g]++;
+
+  production *p = g < st->n ? ls_match_flat(ls, s, i, e) : 0;
+  if (!p) {
+    /* without context a module nothing rewrites stays as it is, so it
+       only needs its place counted in the generations below */
+    for (int k = g + 1; k <= st->n; k++)
+      st->position[k]++;
+    emit(st, s, i);
+    return;
+  }
+
+  ls->generation = g;
+  stochastic_expansion *x = ls_select_expansion(ls, p, position);
+  if (!x)
+    return;
+
+  ls_string *next = &st->level[g + 1];
+  ls_string_clear(next);
+  ls_expand_flat(ls, x, e, next);
+  if (ls->reference_eval)
+    sxp_arena_reset(ls->scratch);
+
+  for (int k = 0; k < ls_length(next); k++)
+    derive(st, next, k, g + 1);
+}
+
+bool ls_stream(lsystem *ls, int n, ls_sink sink, void *ctx) {
+  if (!ls_context_free(ls)) {
+    fprintf(stderr, "ls_stream: productions with context need whole generations\n");
+    return false;
+  }
+
+  stream st;
+  st.ls = ls;
+  st.n = n;
+  st.level.resize(n + 1);
+  st.position.assign(n + 1, 0);
+  st.sink = sink;
+  st.ctx = ctx;
+
+  if (!ls_from_sxp(&st.level[0], ls->axiom)) {
+    fprintf(stderr, "ls_stream: axiom does not fit a flat string\n");
+    exit(-1);
+  }
+
+  /* the tree walker's temporaries go to the scratch arena */
+  ls_span span;
+  ls_span_begin(&span, ls_trace_phases, "stream", "generations", n);
+  sxp_arena *old = sxp_set_arena(ls->scratch);
+  sxp_arena_reset(ls->scratch);
+  for (int i = 0; i < ls_length(&st.level[0]); i++)
+    derive(&st, &st.level[0], i, 0);
+  sxp_set_arena(old);
+  ls_span_end(&span);
+
+  if (ls_length(&st.out))
+    sink(ctx, &st.out);
+  ls->generation = n;
+  return true;
+}
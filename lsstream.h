@@ -0,0 +1,23 @@
+#ifndef LSSTREAM_H
+#define LSSTREAM_H
+
+#include "lsystems.h"
+
+/* depth first derivation of context free lsystems. each module of the
+   axiom is expanded n levels deep before the next is looked at, so only
+   the expansions on the current path are held: memory grows with n times
+   the longest expansion instead of with the length of generation n.
+
+   generation n is handed to sink in order, in pieces of at most
+   LS_STREAM_BATCH modules (brackets count as modules, and a piece may
+   end inside a branch). the pieces put together equal ls_run_flat(ls, n)
+   with the same seed. fails on lsystems with context */
+
+#define LS_STREAM_BATCH 4096
+
+typedef void (*ls_sink)(void *ctx, const ls_string *modules);
+
+bool ls_context_free(lsystem *ls);
+bool ls_stream(lsystem *ls, int n, ls_sink sink, void *ctx);
+
+#endif
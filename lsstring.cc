@@ -0,0 +1,114 @@
+#include "lsstring.h"
+
+void ls_string_clear(ls_string *s) {
+  s->symbol.clear();
+  s->start.assign(1, 0);
+  s->value.clear();
+  s->type.clear();
+}
+
+void ls_index_brackets(const ls_string *s, std::vector<int> &match) {
+  std::vector<int> open;
+  int n = ls_length(s);
+
+  match.assign(n, -1);
+  for (int i = 0; i < n; i++) {
+    if (s->symbol[i] == LS_OPEN)
+      open.push_back(i);
+    else if (s->symbol[i] == LS_CLOSE) {
+      match[i] = open.back();
+      match[open.back()] = i;
+      open.pop_back();
+    }
+  }
+}
+
+size_t ls_string_bytes(const ls_string *s) {
+  return s->symbol.size() * sizeof(int) + s->start.size() * sizeof(unsigned int)
+    + s->value.size() * (sizeof(double) + sizeof(unsigned char));
+}
+
+/* element is what an sxp string element wraps: either a module (a
+   symbol followed by its parameters) or a branch (a list of elements) */
+bool ls_append_element(ls_string *s, sxp *element) {
+  if (!element) {
+    /* an empty element is kept as an empty branch */
+    ls_push_module(s, LS_OPEN);
+    ls_push_module(s, LS_CLOSE);
+    return true;
+  }
+
+  if (element->type == ty_sxp) {
+    ls_push_module(s, LS_OPEN);
+    if (!ls_from_sxp(s, element))
+      return false;
+    ls_push_module(s, LS_CLOSE);
+    return true;
+  }
+
+  if (element->type != ty_symbol)
+    return false;
+
+  ls_push_module(s, element->sym);
+  for (sxp *t = element->next; t; t = t->next) {
+    switch (t->type) {
+    case ty_integer:
+      ls_push_param(s, ty_integer, t->Z);
+      break;
+    case ty_float:
+      ls_push_param(s, ty_float, t->R);
+      break;
+    case ty_symbol:
+      ls_push_param(s, ty_symbol, t->sym);
+      break;
+    default:
+      return false;
+    }
+  } return true;
+}
+
+bool ls_from_sxp(ls_string *s, sxp *x) {
+  for (; x; x = x->next) {
+    if (x->type != ty_sxp || !ls_append_element(s, x->down))
+      return false;
+  } return true;
+}
+
+sxp *ls_to_sxp(const ls_string *s) {
+  std::vector<sxp **> stack;
+  sxp *head = 0, **tail = &head;
+  int n = ls_length(s);
+
+  for (int i = 0; i < n; i++) {
+    int sym = s->symbol[i];
+    if (sym == LS_OPEN) {
+      sxp *b = sxp_makesxp(0, 0);
+      *tail = b;
+      stack.push_back(&b->next);
+      tail = &b->down;
+      continue;
+    } else if (sym == LS_CLOSE) {
+      tail = stack.back();
+      stack.pop_back();
+      continue;
+    }
+
+    sxp *m = sxp_makesym(sym, 0), **param = &m->next;
+    for (unsigned int k = s->start[i]; k < s->start[i + 1]; k++) {
+      switch (s->type[k]) {
+      case ty_integer:
+	*param = sxp_makeint((int) s->value[k], 0);
+	break;
+      case ty_float:
+	*param = sxp_makefloat(s->value[k], 0);
+	break;
+      case ty_symbol:
+	*param = sxp_makesym((int) s->value[k], 0);
+	break;
+      } param = &(*param)->next;
+    }
+
+    *tail = sxp_makesxp(m, 0);
+    tail = &(*tail)->next;
+  } return head;
+}
@@ -0,0 +1,68 @@
+#ifndef LSSTRING_H
+#define LSSTRING_H
+
+#include "sexp.h"
+#include <vector>
+
+/* a derived string as flat arrays instead of linked sxp lists. module i
+   is named symbol[i] and owns parameters start[i] .. start[i+1]-1 of the
+   value/type pool; start has a final entry marking the end of the pool.
+   a branch is bracketed by LS_OPEN and LS_CLOSE entries, which have no
+   parameters. parameters keep their sxp type (ty_integer, ty_float or
+   ty_symbol; integers and symbol ids are exact in the double), so
+   converting to and from sxp is lossless */
+
+#define LS_OPEN -1
+#define LS_CLOSE -2
+
+typedef struct t_ls_string {
+  std::vector<int> symbol;
+  std::vector<unsigned int> start;
+  std::vector<double> value;
+  std::vector<unsigned char> type;
+
+  t_ls_string() : start(1, 0) {}
+} ls_string;
+
+static inline void ls_push_module(ls_string *s, int sym) {
+  s->symbol.push_back(sym);
+  s->start.push_back(s->start.back());
+}
+
+/* add a parameter to the last module */
+static inline void ls_push_param(ls_string *s, int type, double v) {
+  s->value.push_back(v);
+  s->type.push_back(type);
+  s->start.back()++;
+}
+
+static inline int ls_nparams(const ls_string *s, int i) {
+  return s->start[i + 1] - s->start[i];
+}
+
+/* copy module i of src to the end of s */
+static inline void ls_push_copy(ls_string *s, const ls_string *src, int i) {
+  ls_push_module(s, src->symbol[i]);
+  for (unsigned int k = src->start[i]; k < src->start[i + 1]; k++)
+    ls_push_param(s, src->type[k], src->value[k]);
+}
+
+static inline int ls_length(const ls_string *s) {
+  return s->symbol.size();
+}
+
+void ls_string_clear(ls_string *s);
+
+/* match[i] is the index of the bracket matching bracket i, and -1 for
+   modules; so it is < i for LS_CLOSE and > i for LS_OPEN */
+void ls_index_brackets(const ls_string *s, std::vector<int> &match);
+size_t ls_string_bytes(const ls_string *s);
+
+/* conversion. ls_from_sxp appends; it fails on lists it cannot hold,
+   such as a list nested inside a module's parameters. ls_to_sxp
+   allocates with the sxp_make* constructors, so into the current arena */
+bool ls_from_sxp(ls_string *s, sxp *x);
+bool ls_append_element(ls_string *s, sxp *element);
+sxp *ls_to_sxp(const ls_string *s);
+
+#endif
@@ -1,11 +1,156 @@
 #include <iostream>
 #include "lsystems.h"
+#include "lsstream.h"
+#include "lsdag.h"
+#include "lsrope.h"
+#include "lsbin.h"
+#include "lstext.h"
+#include "lscheckpoint.h"
+#include "lscache.h"
+#include "lstrace.h"
+#include "lscompiled.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+static lsystem *profiled;	/* -P's */
+static char *trace;		/* -T's */
+
+/* flush the outputs, and return what main should */
+static int finish(ls_text *text, ls_bin_writer *out) {
+  bool ok = ls_text_finish(text);
+  if (out && !ls_bin_finish(out))
+    ok = false;
+  if (profiled)
+    dump_profile(profiled, stderr);
+  if (trace && !ls_trace_write(trace))
+    ok = false;
+  return ok ? 0 : -1;
+}
+
+static int load_directory(const char *dir, int threads) {
+  std::vector<std::string> paths;
+  std::vector<lsystem *> loaded;
+  int n = ls_load_directory(dir, paths, loaded, threads);
+  if (n < 0) {
+    printf("couldn't read %s\n", dir);
+    return -1;
+  }
+  for (int i = 0; i < paths.size(); i++) {
+    if (loaded[i])
+      printf("%s: %d productions\n", paths[i].c_str(),
+	     (int) loaded[i]->productions.size());
+    else
+      printf("%s: not loaded\n", paths[i].c_str());
+  }
+  printf("%d of %d loaded\n", n, (int) paths.size());
+  return n == paths.size() ? 0 : -1;
+}
 
 int main(int argc, char *argv[]) {
+  /* -r evaluates with the tree walker, for comparing against the vm.
+     -f derives with flat strings instead of sxp lists, -j n rewrites
+     them with n threads. -s picks the seed, which is otherwise the time.
+     -d streams the last generation depth first, without the others, and
+     -m derives it with memoized expansion. -p derives with piece tables.
+     -o writes the last generation to a file in the binary format instead
+     of printing the generations. -t picks how they're printed: sexp,
+     abop, or debug, the default. -c derives the last generation saving a
+     checkpoint to a file after every generation, carrying on from the
+     checkpoint if the file is there. -C derives the last generation
+     through a cache in a directory. -P writes the production counters
+     to stderr as json at the end, if they were compiled in. -T writes a
+     timeline of the phases to a file as chrome trace json, -TT of every
+     expansion and branch as well. -M derives the last generation with
+     ls_run, or ls_run_flat with -f, holding it to a budget of so many
+     bytes (0 for none), and writes the memory of every generation to
+     stderr as json. -O writes what loading optimized to stderr as json. -x derives
+     flat strings with a rewriter lsc compiled into a shared library. -L
+     loads every .ls file of the directory given for definitions on the
+     -j threads and lists them, deriving nothing */
+  bool reference = false, flat = false, depth = false, memo = false;
+  bool rope = false, profile = false, memory = false, optimized = false;
+  bool directory = false;
+  unsigned long long budget = 0;
+  char *output = 0, *checkpoint = 0, *cache = 0, *compiled = 0;
+  int dialect = ls_debug;
+  int threads = 1;
+  unsigned long long seed = time(0);
+  while (argc > 1 && argv[1][0] == '-' && argv[1][1]) {
+    if (!strcmp(argv[1], "-r"))
+      reference = true;
+    else if (!strcmp(argv[1], "-f"))
+      flat = true;
+    else if (!strcmp(argv[1], "-d"))
+      depth = true;
+    else if (!strcmp(argv[1], "-m"))
+      memo = true;
+    else if (!strcmp(argv[1], "-p"))
+      rope = true;
+    else if (!strcmp(argv[1], "-P"))
+      profile = true;
+    else if (!strcmp(argv[1], "-O"))
+      optimized = true;
+    else if (!strcmp(argv[1], "-L"))
+      directory = true;
+    else if (!strcmp(argv[1], "-j") && argc > 2) {
+      flat = true;
+      threads = atoi(argv[2]);
+      --argc;
+      ++argv;
+    } else if (!strcmp(argv[1], "-x") && argc > 2) {
+      flat = true;
+      compiled = argv[2];
+      --argc;
+      ++argv;
+    } else if (!strcmp(argv[1], "-o") && argc > 2) {
+      output = argv[2];
+      --argc;
+      ++argv;
+    } else if ((!strcmp(argv[1], "-T") || !strcmp(argv[1], "-TT"))
+	       && argc > 2) {
+      if (argv[1][2])
+	ls_trace_start(ls_trace_modules, 1 << 20);
+      else
+	ls_trace_start(ls_trace_phases, 1 << 16);
+      trace = argv[2];
+      --argc;
+      ++argv;
+    } else if (!strcmp(argv[1], "-M") && argc > 2) {
+      memory = true;
+      budget = strtoull(argv[2], 0, 10);
+      --argc;
+      ++argv;
+    } else if (!strcmp(argv[1], "-c") && argc > 2) {
+      checkpoint = argv[2];
+      --argc;
+      ++argv;
+    } else if (!strcmp(argv[1], "-C") && argc > 2) {
+      cache = argv[2];
+      --argc;
+      ++argv;
+    } else if (!strcmp(argv[1], "-t") && argc > 2) {
+      if ((dialect = ls_dialect(argv[2])) < 0) {
+	printf("no dialect %s; there's sexp, abop and debug\n", argv[2]);
+	return -1;
+      }
+      --argc;
+      ++argv;
+    } else if (!strcmp(argv[1], "-s") && argc > 2) {
+      seed = strtoull(argv[2], 0, 10);
+      --argc;
+      ++argv;
+    } else
+      break;
+    --argc;
+    ++argv;
+  }
+
+  if (directory && argc > 1)
+    return load_directory(argv[1], threads);
   if (argc < 3) {
-    printf("usage: lstest [definitions] [generations]\n");
+    printf("usage: lstest [-r] [-f] [-d] [-m] [-p] [-P] [-O] [-L] [-j threads] [-x library] [-s seed] [-o file] [-T[T] file] [-M bytes] [-t dialect] [-c file] [-C directory] [definitions] [generations]\n");
     return 0;
   }
   
@@ -13,19 +158,163 @@ int main(int argc, char *argv[]) {
   lsystem *l = ls_load(argv[1]);
   if (!l)
     return -1;
+  l->reference_eval = reference;
+  l->memory_limit = budget;
+  if (profile)
+    profiled = l;
+  if (optimized)
+    dump_optimization(l, stderr);
+  if (compiled && !ls_use_compiled(l, compiled))
+    return -1;
+  ls_set_threads(l, threads);
   
   if (ngen < 0) {
     printf("positive generations only please.\n");
     return -2;
   }
 
+  ls_bin_writer *out = 0;
+  if (output && !(out = ls_bin_create(output)))
+    return -1;
+
   dump_lsystem(l);
-  long seed = time(0);
   printf("%d generations of evolution:\n\n", ngen);
-  for (int i = 0; i < ngen; i++) {
-    srand(seed);
-    sxp_print(ls_run(l, i)); printf("\n\n");
+
+  /* the generations are written past stdio, so it goes out first */
+  fflush(stdout);
+  ls_text *text = ls_text_fd(1, dialect);
+  ls_sink sink = ls_text_sink;
+  void *ctx = text;
+  if (out) {
+    sink = ls_bin_sink;
+    ctx = out;
   }
 
-  return 0;
+  if (depth) {
+    ls_seed(l, seed);
+    if (ngen > 0 && !ls_stream(l, ngen - 1, sink, ctx)) {
+      finish(text, out);
+      return -1;
+    }
+    ls_text_raw(text, "\n\n", 2);
+    return finish(text, out);
+  }
+
+  if (memo) {
+    ls_dag *dag = ngen > 0 ? ls_run_dag(l, ngen - 1) : 0;
+    if (ngen > 0 && !dag) {
+      finish(text, out);
+      return -1;
+    }
+    if (dag) {
+      ls_dag_stream(dag, sink, ctx);
+      fprintf(stderr, "memo: %llu hits, %llu misses, %d nodes, %llu modules\n",
+	      dag->hits, dag->misses, (int) dag->leaf.size(),
+	      dag->length[dag->root]);
+      ls_dag_free(dag);
+    }
+    ls_text_raw(text, "\n\n", 2);
+    return finish(text, out);
+  }
+
+  if (rope) {
+    ls_seed(l, seed);
+    ls_rope *r = ls_rope_new(l);
+    for (int i = 0; i < ngen; i++) {
+      if (i > 0)
+	ls_apply_rope(l, r);
+      if (out && i < ngen - 1)
+	continue;
+      ls_string s;
+      ls_rope_flatten(r, &s);
+      sink(ctx, &s);
+      ls_text_raw(text, "\n\n", 2);
+    } ls_rope_free(r);
+    return finish(text, out);
+  }
+
+  if (checkpoint) {
+    ls_seed(l, seed);
+    if (ngen > 0) {
+      ls_string *s = access(checkpoint, F_OK)
+	? ls_run_checkpointed(l, ngen - 1, checkpoint, 1)
+	: ls_resume(l, ngen - 1, checkpoint, 1);
+      if (!s) {
+	finish(text, out);
+	return -1;
+      }
+      sink(ctx, s);
+    }
+    ls_text_raw(text, "\n\n", 2);
+    return finish(text, out);
+  }
+
+  if (cache) {
+    ls_cache *c = ls_cache_open(cache, 0);
+    if (!c) {
+      finish(text, out);
+      return -1;
+    }
+    ls_seed(l, seed);
+    if (ngen > 0) {
+      ls_string *s = ls_run_cached(c, l, ngen - 1);
+      if (!s) {
+	ls_cache_close(c);
+	finish(text, out);
+	return -1;
+      }
+      sink(ctx, s);
+    }
+    fprintf(stderr, "cache: %llu hits, %llu partial, %llu misses\n",
+	    c->hits, c->partial, c->misses);
+    ls_cache_close(c);
+    ls_text_raw(text, "\n\n", 2);
+    return finish(text, out);
+  }
+
+  if (memory) {
+    ls_seed(l, seed);
+    if (ngen > 0 && flat) {
+      ls_string *s = ls_run_flat(l, ngen - 1);
+      if (s)
+	sink(ctx, s);
+    } else if (ngen > 0) {
+      sxp *words = ls_run(l, ngen - 1);
+      bool written = out ? ls_bin_write_sxp(out, words)
+	: ls_text_sxp(text, words);
+      if (!l->over_budget && !written)
+	fprintf(stderr, "generation %d can't be written that way\n", ngen - 1);
+    }
+    dump_memory(l, stderr);
+    ls_text_raw(text, "\n\n", 2);
+    int status = finish(text, out);
+    return l->over_budget ? -1 : status;
+  }
+
+  ls_derivation *d = ls_begin(l, seed);
+  for (int i = 0; i < ngen; i++) {
+    ls_string *s = 0;
+    sxp *words = 0;
+    if (out || flat)
+      s = ls_step_flat(d);
+    else
+      words = ls_step(d);
+    if (l->over_budget) {
+      ls_end(d);
+      finish(text, out);
+      return -1;
+    }
+
+    if (out) {
+      if (i == ngen - 1)
+	ls_bin_write(out, s);
+      continue;
+    } else if (flat)
+      ls_text_string(text, s);
+    else if (!ls_text_sxp(text, words))
+      fprintf(stderr, "generation %d can't be written in that dialect\n", i);
+    ls_text_raw(text, "\n\n", 2);
+  } ls_end(d);
+
+  return finish(text, out);
 }
@@ -0,0 +1,299 @@
+#include "lstext.h"
+#include <charconv>
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define LS_TEXT_BUFFER (1 << 20)
+#define LS_TEXT_NUMBER 400	/* room for any number, %f of 1e308 included */
+
+struct t_ls_text {
+  int fd;			/* -1 for memory */
+  int dialect;
+  bool failed;
+  bool fresh;			/* nothing yet in the current list */
+  char *buf;
+  size_t len, cap;
+
+  std::vector<const char *> names; /* symbol id -> name, as they're met */
+  std::vector<int> lengths;
+  std::vector<sxp *> stack;	/* rest of each list ls_text_sxp is in */
+  ls_string flat;		/* for showing sxp as ls_abop */
+};
+
+static ls_text *new_text(int fd, int dialect) {
+  ls_text *t = new ls_text;
+  t->fd = fd;
+  t->dialect = dialect;
+  t->failed = false;
+  t->fresh = true;
+  t->cap = LS_TEXT_BUFFER;
+  t->buf = (char *) malloc(t->cap);
+  t->len = 0;
+  return t;
+}
+
+ls_text *ls_text_fd(int fd, int dialect) {
+  return new_text(fd, dialect);
+}
+
+ls_text *ls_text_memory(int dialect) {
+  return new_text(-1, dialect);
+}
+
+static void write_out(ls_text *t) {
+  size_t done = 0;
+  while (done < t->len) {
+    ssize_t n = write(t->fd, t->buf + done, t->len - done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      t->failed = true;
+      break;
+    } done += n;
+  } t->len = 0;
+}
+
+/* make room for n more characters */
+static void reserve(ls_text *t, size_t n) {
+  if (t->len + n <= t->cap)
+    return;
+  if (t->fd >= 0)
+    write_out(t);
+  if (t->len + n > t->cap) {
+    while (t->len + n > t->cap)
+      t->cap *= 2;
+    t->buf = (char *) realloc(t->buf, t->cap);
+  }
+}
+
+static void put(ls_text *t, const char *s, size_t n) {
+  reserve(t, n);
+  memcpy(t->buf + t->len, s, n);
+  t->len += n;
+}
+
+static void put_char(ls_text *t, char c) {
+  reserve(t, 1);
+  t->buf[t->len++] = c;
+}
+
+static void put_name(ls_text *t, int sym) {
+  if (sym < 0 || sym >= t->names.size()) {
+    if (sym < 0)
+      return put(t, "[bad symbol]", 12);
+    t->names.resize(sym + 1, 0);
+    t->lengths.resize(sym + 1, 0);
+  }
+  if (!t->names[sym]) {
+    t->names[sym] = sxp_symbol_name(sym);
+    t->lengths[sym] = strlen(t->names[sym]);
+  } put(t, t->names[sym], t->lengths[sym]);
+}
+
+/* numbers */
+
+static int format_float(char *buf, double v, int dialect) {
+  if (dialect == ls_debug) {
+    memcpy(buf, "float:", 6);	/* %f, digit for digit */
+    return std::to_chars(buf + 6, buf + LS_TEXT_NUMBER, v,
+			 std::chars_format::fixed, 6).ptr - buf;
+  }
+  if (!isfinite(v)) {
+    const char *name = isnan(v) ? "nan" : v < 0 ? "-inf" : "inf";
+    strcpy(buf, name);
+    return strlen(name);
+  }
+
+  /* the shortest fixed notation that reads back exactly */
+  char *end = std::to_chars(buf, buf + LS_TEXT_NUMBER, v,
+			    std::chars_format::fixed).ptr;
+  if (dialect == ls_sexp && !memchr(buf, '.', end - buf)) {
+    memcpy(end, ".0", 2);	/* so it reads back as a float */
+    end += 2;
+  } return end - buf;
+}
+
+static int format_number(char *buf, int type, double v, int dialect) {
+  if (type == ty_float)
+    return format_float(buf, v, dialect);
+
+  char *p = buf;
+  if (dialect == ls_debug) {
+    memcpy(p, "int:", 4);
+    p += 4;
+  } return std::to_chars(p, buf + LS_TEXT_NUMBER, (int) v).ptr - buf;
+}
+
+static void put_param(ls_text *t, int type, double v) {
+  if (type == ty_symbol)
+    return put_name(t, (int) v);
+  reserve(t, LS_TEXT_NUMBER);
+  t->len += format_number(t->buf + t->len, type, v, t->dialect);
+}
+
+/* a space between items of a list, but not after its '(' */
+static void separate(ls_text *t) {
+  if (!t->fresh)
+    put_char(t, ' ');
+}
+
+/* flat strings */
+
+static void module_debug(ls_text *t, const ls_string *s, int i) {
+  put(t, " ( ", 3);
+  put_name(t, s->symbol[i]);
+  for (unsigned int k = s->start[i]; k < s->start[i + 1]; k++) {
+    put_char(t, ' ');
+    put_param(t, s->type[k], s->value[k]);
+  } put(t, " )", 2);
+}
+
+static void module_sexp(ls_text *t, const ls_string *s, int i) {
+  separate(t);
+  put_char(t, '(');
+  put_name(t, s->symbol[i]);
+  for (unsigned int k = s->start[i]; k < s->start[i + 1]; k++) {
+    put_char(t, ' ');
+    put_param(t, s->type[k], s->value[k]);
+  } put_char(t, ')');
+  t->fresh = false;
+}
+
+static void module_abop(ls_text *t, const ls_string *s, int i) {
+  put_name(t, s->symbol[i]);
+  if (!ls_nparams(s, i))
+    return;
+  for (unsigned int k = s->start[i]; k < s->start[i + 1]; k++) {
+    put_char(t, k == s->start[i] ? '(' : ',');
+    put_param(t, s->type[k], s->value[k]);
+  } put_char(t, ')');
+}
+
+void ls_text_string(ls_text *t, const ls_string *s) {
+  int n = ls_length(s);
+  for (int i = 0; i < n; i++) {
+    int sym = s->symbol[i];
+    switch (t->dialect) {
+    case ls_debug:
+      if (sym == LS_OPEN)
+	put(t, " (", 2);
+      else if (sym == LS_CLOSE)
+	put(t, " )", 2);
+      else
+	module_debug(t, s, i);
+      break;
+    case ls_sexp:
+      if (sym == LS_OPEN) {
+	separate(t);
+	put_char(t, '(');
+	t->fresh = true;
+      } else if (sym == LS_CLOSE) {
+	put_char(t, ')');
+	t->fresh = false;
+      } else
+	module_sexp(t, s, i);
+      break;
+    case ls_abop:
+      if (sym == LS_OPEN)
+	put_char(t, '[');
+      else if (sym == LS_CLOSE)
+	put_char(t, ']');
+      else
+	module_abop(t, s, i);
+      break;
+    }
+  }
+}
+
+void ls_text_sink(void *t, const ls_string *s) {
+  ls_text_string((ls_text *) t, s);
+}
+
+/* sxp lists, walked with a stack of where each enclosing list goes on */
+
+bool ls_text_sxp(ls_text *t, sxp *x) {
+  if (t->dialect == ls_abop) {
+    ls_string_clear(&t->flat);
+    if (!ls_from_sxp(&t->flat, x))
+      return false;
+    ls_text_string(t, &t->flat);
+    return true;
+  }
+
+  bool debug = t->dialect == ls_debug;
+  t->stack.clear();
+  for (;;) {
+    if (!x) {
+      if (t->stack.empty())
+	break;
+      if (debug)
+	put(t, " )", 2);
+      else
+	put_char(t, ')');
+      t->fresh = false;
+      x = t->stack.back();
+      t->stack.pop_back();
+      continue;
+    }
+
+    if (debug)
+      put_char(t, ' ');
+    else
+      separate(t);
+    t->fresh = false;
+    switch (x->type) {
+    case ty_sxp:
+      put_char(t, '(');
+      t->fresh = true;
+      t->stack.push_back(x->next);
+      x = x->down;
+      continue;
+    case ty_integer:
+      put_param(t, ty_integer, x->Z);
+      break;
+    case ty_float:
+      put_param(t, ty_float, x->R);
+      break;
+    case ty_symbol:
+      put_name(t, x->sym);
+      break;
+    } x = x->next;
+  } return true;
+}
+
+/* text that isn't a string, such as line breaks. what follows it starts
+   a new list as far as spacing goes */
+void ls_text_raw(ls_text *t, const char *text, size_t len) {
+  put(t, text, len);
+  t->fresh = true;
+}
+
+bool ls_text_flush(ls_text *t) {
+  if (t->fd >= 0)
+    write_out(t);
+  return !t->failed;
+}
+
+const char *ls_text_data(ls_text *t, size_t *len) {
+  *len = t->len;
+  return t->buf;
+}
+
+bool ls_text_finish(ls_text *t) {
+  bool ok = ls_text_flush(t);
+  free(t->buf);
+  delete t;
+  return ok;
+}
+
+int ls_dialect(const char *name) {
+  static const char *names[] = {"sexp", "abop", "debug"};
+  for (int i = 0; i < 3; i++)
+    if (!strcmp(name, names[i]))
+      return i;
+  return -1;
+}
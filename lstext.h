@@ -0,0 +1,40 @@
+#ifndef LSTEXT_H
+#define LSTEXT_H
+
+#include "lsstring.h"
+#include <stddef.h>
+
+/* text output of derived strings, buffered instead of a printf per token
+   and without recursion. a writer has one of three dialects:
+
+     ls_sexp	s-expressions that sxp_parse and sxp_next read back to the
+		same values: (A 1 2.5) ((B)). floats keep a '.' and are
+		written with the fewest digits that read back exactly;
+		infinities and nans, which have no such form, come out as
+		symbols
+     ls_abop	the notation of the Algorithmic Beauty of Plants, with
+		brackets for branches: A(1,2.5)[B]
+     ls_debug	what sxp_print prints: ( A int:1 float:2.500000 ) ( ( B ) )
+
+   the text goes to a file descriptor, written out whenever the buffer
+   fills, or to memory */
+
+enum {
+  ls_sexp, ls_abop, ls_debug
+};
+
+typedef struct t_ls_text ls_text;
+
+ls_text *ls_text_fd(int fd, int dialect);
+ls_text *ls_text_memory(int dialect);
+void ls_text_string(ls_text *t, const ls_string *s);
+void ls_text_sink(void *t, const ls_string *s);	/* an ls_sink */
+bool ls_text_sxp(ls_text *t, sxp *x);	/* false if ls_abop can't show it */
+void ls_text_raw(ls_text *t, const char *text, size_t len);
+bool ls_text_flush(ls_text *t);		/* false if a write failed */
+const char *ls_text_data(ls_text *t, size_t *len); /* a memory writer's */
+bool ls_text_finish(ls_text *t);	/* flushes and frees */
+
+int ls_dialect(const char *name);	/* -1 if there's none by that name */
+
+#endif
@@ -0,0 +1,137 @@
+#include "lstrace.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+int ls_trace_detail = ls_trace_off;
+
+typedef struct t_trace_event {
+  const char *name, *key;
+  int arg;
+  unsigned long long start, end;
+} trace_event;
+
+/* the events are left uninitialized, so a big ring costs its pages only
+   as they're recorded into */
+typedef struct t_ring {
+  trace_event *events;
+  size_t size;
+  unsigned long long recorded;	/* ever; the ring holds the last ones */
+} ring;
+
+/* the rings of the current timeline, one per thread that recorded into
+   it. a thread finds its own through mine, which is only good while
+   my_session is the current session */
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<ring *> rings;
+static int session;
+static size_t ring_size;
+static unsigned long long epoch;
+static __thread ring *mine;
+static __thread int my_session;
+
+unsigned long long ls_trace_clock() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+static void drop_rings() {
+  for (int i = 0; i < rings.size(); i++) {
+    delete[] rings[i]->events;
+    delete rings[i];
+  }
+  rings.clear();
+}
+
+void ls_trace_start(int detail, size_t events) {
+  pthread_mutex_lock(&rings_lock);
+  drop_rings();
+  session++;
+  ring_size = events ? events : 1;
+  epoch = ls_trace_clock();
+  pthread_mutex_unlock(&rings_lock);
+  ls_trace_detail = detail;
+}
+
+void ls_trace_stop() {
+  ls_trace_detail = ls_trace_off;
+}
+
+static ring *own_ring() {
+  pthread_mutex_lock(&rings_lock);
+  if (my_session != session) {
+    mine = new ring;
+    mine->events = new trace_event[ring_size];
+    mine->size = ring_size;
+    mine->recorded = 0;
+    my_session = session;
+    rings.push_back(mine);
+  }
+  pthread_mutex_unlock(&rings_lock);
+  return mine;
+}
+
+void ls_trace_record(ls_span *s) {
+  unsigned long long end = ls_trace_clock();
+  ring *r = mine && my_session == session ? mine : own_ring();
+  trace_event *e = &r->events[r->recorded++ % r->size];
+  e->name = s->name;
+  e->key = s->key;
+  e->arg = s->arg;
+  e->start = s->start;
+  e->end = end;
+}
+
+/* writing. times are microseconds from the start of the timeline */
+
+static void write_time(FILE *f, unsigned long long ns) {
+  fprintf(f, "%llu.%03llu", ns / 1000, ns % 1000);
+}
+
+bool ls_trace_write(const char *path) {
+  FILE *f = fopen(path, "w");
+  if (!f) {
+    fprintf(stderr, "ls_trace_write: couldn't open %s\n", path);
+    return false;
+  }
+
+  pthread_mutex_lock(&rings_lock);
+  int pid = getpid();
+  bool first = true;
+  fprintf(f, "{\"traceEvents\": [");
+  for (int t = 0; t < rings.size(); t++) {
+    ring *r = rings[t];
+    fprintf(f, "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d,"
+	    " \"tid\": %d, \"args\": {\"name\": \"thread %d\"}}",
+	    first ? "" : ",", pid, t, t);
+    first = false;
+
+    /* oldest first */
+    unsigned long long n = r->size;
+    unsigned long long from = r->recorded > n ? r->recorded - n : 0;
+    for (unsigned long long i = from; i < r->recorded; i++) {
+      trace_event *e = &r->events[i % n];
+      unsigned long long start = e->start > epoch ? e->start - epoch : 0;
+      fprintf(f, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": %d,"
+	      " \"tid\": %d, \"ts\": ", e->name, pid, t);
+      write_time(f, start);
+      fprintf(f, ", \"dur\": ");
+      write_time(f, e->end - e->start);
+      if (e->key)
+	fprintf(f, ", \"args\": {\"%s\": %d}", e->key, e->arg);
+      fprintf(f, "}");
+    }
+  }
+  fprintf(f, "\n], \"displayTimeUnit\": \"ms\"}\n");
+  pthread_mutex_unlock(&rings_lock);
+
+  bool ok = !ferror(f);
+  if (fclose(f))
+    ok = false;
+  if (!ok)
+    fprintf(stderr, "ls_trace_write: couldn't write %s\n", path);
+  return ok;
+}
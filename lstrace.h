@@ -0,0 +1,61 @@
+#ifndef LSTRACE_H
+#define LSTRACE_H
+
+#include <stddef.h>
+
+/* a timeline of where a derivation spends its time, written as chrome
+   trace-event json for a trace viewer (chrome://tracing, perfetto).
+
+   a span is timed between ls_span_begin and ls_span_end and recorded
+   into a ring buffer of the thread that ended it, so threads never
+   share a buffer; a full ring overwrites its oldest spans. spans come
+   in two levels of detail:
+
+     ls_trace_phases	loading, generations, bracket indexing and
+			flattening, the matching loop, parallel chunks and
+			their stitching, checkpoint saves
+     ls_trace_modules	also each expansion evaluated and each branch of
+			the string, which is a span per module or so
+
+   when tracing is off, or at a lower detail than a span's, a span costs
+   one comparison. start, stop and write while no derivation is running */
+
+enum {
+  ls_trace_off, ls_trace_phases, ls_trace_modules
+};
+
+extern int ls_trace_detail;
+
+/* start a new timeline, dropping any spans of the last; events is the
+   size of each thread's ring */
+void ls_trace_start(int detail, size_t events);
+void ls_trace_stop();
+bool ls_trace_write(const char *path);	/* false if it couldn't */
+
+typedef struct t_ls_span {
+  const char *name;		/* static strings only, as are keys */
+  const char *key;		/* names arg, or 0 for none */
+  int arg;
+  unsigned long long start;	/* 0 if not recorded */
+} ls_span;
+
+unsigned long long ls_trace_clock();	/* nanoseconds */
+void ls_trace_record(ls_span *s);
+
+static inline void ls_span_begin(ls_span *s, int detail, const char *name,
+				 const char *key, int arg) {
+  s->start = 0;
+  if (ls_trace_detail < detail)
+    return;
+  s->name = name;
+  s->key = key;
+  s->arg = arg;
+  s->start = ls_trace_clock();
+}
+
+static inline void ls_span_end(ls_span *s) {
+  if (s->start)
+    ls_trace_record(s);
+}
+
+#endif
@@ -0,0 +1,434 @@
+#include "lsvm.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* compiler */
+
+static void emit_insn(vm_program *p, int op, int dst, int a, int b, int k) {
+  vm_insn i;
+  i.op = op;
+  i.dst = dst;
+  i.a = a;
+  i.b = b;
+  i.k = k;
+  p->code.push_back(i);
+}
+
+static int add_constant(vm_program *p, double v) {
+  for (int i = 0; i < (int) p->constants.size(); i++)
+    if (p->constants[i] == v)
+      return i;
+  p->constants.push_back(v);
+  return p->constants.size() - 1;
+}
+
+typedef std::vector<int> slots;
+
+static int slot_of(slots &params, int sym) {
+  for (int i = 0; i < params.size(); i++)
+    if (params[i] == sym)
+      return i;
+  return -1;
+}
+
+/* the arguments an expansion has computed so far. their registers hold
+   them until the emit steps run, so a later argument, or an operand of
+   one, that is computed the same way can read the register instead */
+typedef struct t_computed {
+  std::vector<sxp *> expr;
+  std::vector<int> reg;
+  int shared;
+} computed;
+
+static int computed_reg(computed *c, sxp *expr) {
+  if (!c)
+    return -1;
+  for (int i = 0; i < c->expr.size(); i++)
+    if (sxp_isequal(c->expr[i], expr))
+      return c->reg[i];
+  return -1;
+}
+
+static bool compile_op(vm_program *p, slots &params, sxp *expr, int dst,
+		       int top, computed *c);
+
+/* compile a single operand into register dst. top is the first free
+   register, everything below it is in use. c is 0 outside expansions */
+static bool compile_arg(vm_program *p, slots &params, sxp *arg, int dst,
+			int top, computed *c) {
+  int reg;
+
+  switch (arg->type) {
+  case ty_integer:
+    emit_insn(p, vm_const, dst, 0, 0, add_constant(p, arg->Z));
+    return true;
+  case ty_float:
+    emit_insn(p, vm_const, dst, 0, 0, add_constant(p, arg->R));
+    return true;
+  case ty_symbol:
+    /* anything but a parameter is left for the tree walker to reject */
+    if (slot_of(params, arg->sym) < 0)
+      return false;
+    emit_insn(p, vm_var, dst, 0, 0, slot_of(params, arg->sym));
+    return true;
+  case ty_sxp:
+    if ((reg = computed_reg(c, arg->down)) >= 0) {
+      emit_insn(p, vm_mov, dst, reg, 0, 0);
+      c->shared++;
+      return true;
+    } return compile_op(p, params, arg->down, dst, top, c);
+  } return false;
+}
+
+/* operators with a running result: r = arg1, then r = r op argN */
+static bool compile_fold(vm_program *p, slots &params, int op, sxp *args,
+			 int dst, int top, double empty, computed *c) {
+  if (!args) {
+    emit_insn(p, vm_const, dst, 0, 0, add_constant(p, empty));
+    return true;
+  }
+
+  /* 0 + a is not always a (think -0), so addition starts from 0 like
+     ls_eval_add does */
+  if (op == vm_add) {
+    emit_insn(p, vm_const, dst, 0, 0, add_constant(p, 0));
+  } else {
+    if (!compile_arg(p, params, args, dst, top, c))
+      return false;
+    args = args->next;
+  }
+
+  if (top >= LS_VM_REGS)
+    return false;
+  while (args) {
+    if (!compile_arg(p, params, args, top, top + 1, c))
+      return false;
+    emit_insn(p, op, dst, dst, top, 0);
+    args = args->next;
+  } return true;
+}
+
+static bool compile_op(vm_program *p, slots &params, sxp *expr, int dst,
+		       int top, computed *c) {
+  if (!expr || expr->type != ty_symbol)
+    return false;
+  if (top + 2 > LS_VM_REGS)
+    return false;
+
+  int op = ls_operator(expr->sym);
+  sxp *args = expr->next;
+  int n = sxp_length(args);
+  int insn, result;
+
+  switch (op) {
+  case op_add:
+    return compile_fold(p, params, vm_add, args, dst, top, 0, c);
+  case op_sub:
+    return compile_fold(p, params, vm_sub, args, dst, top, 0, c);
+  case op_mul:
+    return compile_fold(p, params, vm_mul, args, dst, top, 1, c);
+  case op_div:
+    return compile_fold(p, params, vm_div, args, dst, top, 0, c);
+
+  case op_eq: insn = vm_eq; goto compare;
+  case op_lt: insn = vm_lt; goto compare;
+  case op_gt: insn = vm_gt; goto compare;
+  case op_lte: insn = vm_lte; goto compare;
+  case op_gte: insn = vm_gte;
+  compare:
+    if (n != 2)
+      return false;
+    if (!compile_arg(p, params, args, top, top + 2, c)
+	|| !compile_arg(p, params, args->next, top + 1, top + 2, c))
+      return false;
+    emit_insn(p, insn, dst, top, top + 1, 0);
+    return true;
+
+  case op_not:
+    if (n != 1 || !compile_arg(p, params, args, top, top + 1, c))
+      return false;
+    emit_insn(p, vm_not, dst, top, 0, 0);
+    return true;
+
+  case op_and:
+  case op_or: {
+    /* the result is preset to the short circuit value; every operand
+       that triggers the short circuit jumps past the final store */
+    result = op == op_and ? 0 : 1;
+    std::vector<int> jumps;
+
+    emit_insn(p, vm_const, dst, 0, 0, add_constant(p, result));
+    while (args) {
+      if (!compile_arg(p, params, args, top, top + 1, c))
+	return false;
+      jumps.push_back(p->code.size());
+      emit_insn(p, op == op_and ? vm_jz : vm_jone, 0, top, 0, 0);
+      args = args->next;
+    }
+    emit_insn(p, vm_const, dst, 0, 0, add_constant(p, !result));
+    for (int i = 0; i < (int) jumps.size(); i++)
+      p->code[jumps[i]].k = p->code.size();
+    return true;
+  }
+  } return false;
+}
+
+vm_program *vm_compile_condition(sxp *cond, slots &params) {
+  vm_program *p = new vm_program;
+  if (!compile_op(p, params, cond, 0, 1, 0)) {
+    delete p;
+    return 0;
+  } return p;
+}
+
+/* compile one module (A args...) of an expansion. arguments are given
+   registers from top upwards, and keep them until the emit steps run */
+static bool compile_module(vm_expansion *x, slots &params, sxp *m, int &top,
+			   computed *c) {
+  if (!m || m->type != ty_symbol || ls_operator(m->sym) != op_none)
+    return false;
+
+  vm_emit e;
+  e.op = emit_module;
+  e.sym = m->sym;
+  x->emit.push_back(e);
+
+  for (sxp *a = m->next; a; a = a->next) {
+    switch (a->type) {
+    case ty_integer:
+      e.op = emit_int;
+      e.Z = a->Z;
+      break;
+    case ty_float:
+      e.op = emit_float;
+      e.R = a->R;
+      break;
+    case ty_symbol:
+      e.sym = a->sym;
+      e.slot = slot_of(params, a->sym);
+      e.op = e.slot < 0 ? emit_sym : emit_var;
+      break;
+    case ty_sxp:
+      e.op = emit_reg;
+      if ((e.reg = computed_reg(c, a->down)) >= 0) {
+	c->shared++;
+	break;
+      }
+
+      /* only arithmetic is compiled; nested lists go to the tree walker */
+      if (top >= LS_VM_REGS
+	  || !compile_op(&x->prog, params, a->down, top, top + 1, c))
+	return false;
+      c->expr.push_back(a->down);
+      c->reg.push_back(top);
+      e.reg = top++;
+      break;
+    } x->emit.push_back(e);
+  } return true;
+}
+
+/* a branch is a list of modules and nested branches */
+static bool compile_element(vm_expansion *x, slots &params, sxp *d, int &top,
+			    int depth, computed *c) {
+  if (!d)
+    return false;
+  if (d->type == ty_symbol)
+    return compile_module(x, params, d, top, c);
+  if (depth >= LS_VM_DEPTH)
+    return false;
+
+  vm_emit e;
+  e.op = emit_open;
+  x->emit.push_back(e);
+  for (; d; d = d->next) {
+    if (d->type != ty_sxp
+	|| !compile_element(x, params, d->down, top, depth + 1, c))
+      return false;
+  }
+  e.op = emit_close;
+  x->emit.push_back(e);
+  return true;
+}
+
+vm_expansion *vm_compile_expansion(sxp *expansion, slots &params) {
+  vm_expansion *x = new vm_expansion;
+  computed c;
+  c.shared = 0;
+  int top = 0;
+
+  for (sxp *r = expansion; r; r = r->next) {
+    size_t ncode = x->prog.code.size(), nemit = x->emit.size();
+    size_t ncomputed = c.expr.size();
+    int otop = top, oshared = c.shared;
+
+    if (!compile_element(x, params, r->down, top, 0, &c)) {
+      /* fall back to the tree walker for this element */
+      x->prog.code.resize(ncode);
+      x->emit.resize(nemit);
+      c.expr.resize(ncomputed);
+      c.reg.resize(ncomputed);
+      c.shared = oshared;
+      top = otop;
+
+      vm_emit e;
+      e.op = emit_tree;
+      e.tree = r->down;
+      x->emit.push_back(e);
+    }
+  }
+  x->shared = c.shared;
+  return x;
+}
+
+/* interpreter */
+
+static inline double lookup(env *e, int slot) {
+  assert(e->bound & LS_SLOT_BIT(slot));
+  return e->slot[slot];
+}
+
+static void vm_exec(vm_program *p, env *e, double *r) {
+  const vm_insn *code = p->code.empty() ? 0 : &p->code[0];
+  const double *k = p->constants.empty() ? 0 : &p->constants[0];
+  int n = p->code.size();
+
+  for (int pc = 0; pc < n; pc++) {
+    const vm_insn *i = code + pc;
+    switch (i->op) {
+    case vm_const: r[i->dst] = k[i->k]; break;
+    case vm_var: r[i->dst] = lookup(e, i->k); break;
+    case vm_mov: r[i->dst] = r[i->a]; break;
+    case vm_add: r[i->dst] = r[i->a] + r[i->b]; break;
+    case vm_sub: r[i->dst] = r[i->a] - r[i->b]; break;
+    case vm_mul: r[i->dst] = r[i->a] * r[i->b]; break;
+    case vm_div: r[i->dst] = r[i->a] / r[i->b]; break;
+    case vm_eq: r[i->dst] = r[i->a] == r[i->b] ? 1 : 0; break;
+    case vm_lt: r[i->dst] = r[i->a] < r[i->b] ? 1 : 0; break;
+    case vm_gt: r[i->dst] = r[i->a] > r[i->b] ? 1 : 0; break;
+    case vm_lte: r[i->dst] = r[i->a] <= r[i->b] ? 1 : 0; break;
+    case vm_gte: r[i->dst] = r[i->a] >= r[i->b] ? 1 : 0; break;
+    case vm_not: r[i->dst] = r[i->a] == 0 ? 1 : 0; break;
+    case vm_jz:
+      if (r[i->a] == 0)
+	pc = i->k - 1;
+      break;
+    case vm_jone:
+      if (r[i->a] == 1)
+	pc = i->k - 1;
+      break;
+    }
+  }
+}
+
+bool vm_test(vm_program *p, env *e) {
+  double r[LS_VM_REGS];
+  vm_exec(p, e, r);
+  return r[0] > 0;
+}
+
+/* builds the same list the tree walker would: one sxp per expansion
+   element, wrapping either a module or a branch of them */
+sxp *vm_expand(vm_expansion *x, env *e) {
+  double r[LS_VM_REGS];
+  sxp **stack[LS_VM_DEPTH];
+  int depth = 0;
+  sxp *head = 0, **tail = &head, **param = 0;
+
+  vm_exec(&x->prog, e, r);
+
+  std::vector<vm_emit>::iterator i = x->emit.begin();
+  for (; i != x->emit.end(); ++i) {
+    switch (i->op) {
+    case emit_module: {
+      sxp *m = sxp_makesym(i->sym, 0);
+      *tail = sxp_makesxp(m, 0);
+      tail = &(*tail)->next;
+      param = &m->next;
+      break;
+    }
+    case emit_int:
+      *param = sxp_makeint(i->Z, 0);
+      param = &(*param)->next;
+      break;
+    case emit_float:
+      *param = sxp_makefloat(i->R, 0);
+      param = &(*param)->next;
+      break;
+    case emit_reg:
+      *param = sxp_makefloat(r[i->reg], 0);
+      param = &(*param)->next;
+      break;
+    case emit_sym:
+      *param = sxp_makesym(i->sym, 0);
+      param = &(*param)->next;
+      break;
+    case emit_var:
+      if (e->bound & LS_SLOT_BIT(i->slot))
+	*param = sxp_makefloat(e->slot[i->slot], 0);
+      else
+	*param = sxp_makesym(i->sym, 0);
+      param = &(*param)->next;
+      break;
+    case emit_open: {
+      sxp *b = sxp_makesxp(0, 0);
+      *tail = b;
+      stack[depth++] = &b->next;
+      tail = &b->down;
+      break;
+    }
+    case emit_close:
+      tail = stack[--depth];
+      break;
+    case emit_tree:
+      *tail = sxp_makesxp(ls_eval_expr(e, i->tree), 0);
+      tail = &(*tail)->next;
+      break;
+    }
+  } return head;
+}
+
+/* vm_expand appending to a flat string */
+void vm_expand_flat(vm_expansion *x, env *e, ls_string *out) {
+  double r[LS_VM_REGS];
+
+  vm_exec(&x->prog, e, r);
+
+  std::vector<vm_emit>::iterator i = x->emit.begin();
+  for (; i != x->emit.end(); ++i) {
+    switch (i->op) {
+    case emit_module:
+      ls_push_module(out, i->sym);
+      break;
+    case emit_int:
+      ls_push_param(out, ty_integer, i->Z);
+      break;
+    case emit_float:
+      ls_push_param(out, ty_float, i->R);
+      break;
+    case emit_reg:
+      ls_push_param(out, ty_float, r[i->reg]);
+      break;
+    case emit_sym:
+      ls_push_param(out, ty_symbol, i->sym);
+      break;
+    case emit_var:
+      if (e->bound & LS_SLOT_BIT(i->slot))
+	ls_push_param(out, ty_float, e->slot[i->slot]);
+      else
+	ls_push_param(out, ty_symbol, i->sym);
+      break;
+    case emit_open:
+      ls_push_module(out, LS_OPEN);
+      break;
+    case emit_close:
+      ls_push_module(out, LS_CLOSE);
+      break;
+    case emit_tree:
+      if (!ls_append_element(out, ls_eval_expr(e, i->tree))) {
+	fprintf(stderr, "vm_expand_flat: expansion does not fit a flat string\n");
+	exit(-1);
+      } break;
+    }
+  }
+}
@@ -0,0 +1,80 @@
+#ifndef LSVM_H
+#define LSVM_H
+
+#include "lsystems.h"
+#include <vector>
+
+/* conditions and expansion arguments are compiled by parse_production
+   into short programs over a bank of numeric registers. running one
+   walks no trees and allocates nothing; only the modules an expansion
+   emits are allocated. anything the compiler does not understand is left
+   to the tree walking evaluator (ls_eval_expr), which also remains
+   available for every production through lsystem::reference_eval */
+
+#define LS_VM_REGS 64		/* registers per program */
+#define LS_VM_DEPTH 32		/* branch nesting within one expansion */
+
+enum {
+  vm_const,			/* r[dst] = constants[k] */
+  vm_var,			/* r[dst] = parameter slot k */
+  vm_mov,			/* r[dst] = r[a] */
+  vm_add, vm_sub, vm_mul, vm_div, /* r[dst] = r[a] op r[b] */
+  vm_eq, vm_lt, vm_gt, vm_lte, vm_gte, /* r[dst] = r[a] op r[b] ? 1 : 0 */
+  vm_not,			/* r[dst] = r[a] == 0 ? 1 : 0 */
+  vm_jz,			/* if r[a] == 0 jump to k */
+  vm_jone			/* if r[a] == 1 jump to k */
+};
+
+typedef struct t_vm_insn {
+  unsigned char op, dst, a, b;
+  int k;
+} vm_insn;
+
+typedef struct t_vm_program {
+  std::vector<vm_insn> code;
+  std::vector<double> constants;
+} vm_program;
+
+/* an expansion runs one program computing every numeric argument, then
+   replays the emit steps to assemble its modules from the registers. an
+   argument computed the same way as an earlier one, or a part of one
+   that is, takes the earlier one's register instead */
+enum {
+  emit_module,			/* start a module named sym */
+  emit_int,			/* append integer parameter Z */
+  emit_float,			/* append float parameter R */
+  emit_reg,			/* append r[reg] as a float */
+  emit_sym,			/* append symbol sym */
+  emit_var,			/* append parameter slot, or sym if unbound */
+  emit_open,			/* start a branch */
+  emit_close,			/* end the current branch */
+  emit_tree			/* evaluate tree with ls_eval_expr */
+};
+
+typedef struct t_vm_emit {
+  int op;
+  int sym;
+  union {
+    int Z;
+    double R;
+    int reg;
+    int slot;
+    sxp *tree;
+  };
+} vm_emit;
+
+typedef struct t_vm_expansion {
+  vm_program prog;
+  std::vector<vm_emit> emit;
+  int shared;			/* arguments and parts of them that reuse a
+				   register */
+} vm_expansion;
+
+/* params are the production's formal parameters, in slot order */
+vm_program *vm_compile_condition(sxp *cond, std::vector<int> &params);
+vm_expansion *vm_compile_expansion(sxp *expansion, std::vector<int> &params);
+bool vm_test(vm_program *p, env *e);
+sxp *vm_expand(vm_expansion *x, env *e);
+void vm_expand_flat(vm_expansion *x, env *e, ls_string *out);
+
+#endif
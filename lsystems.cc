@@ -1,42 +1,136 @@
 #include "lsystems.h"
+#include "lsvm.h"
+#include "lsopt.h"
+#include "lscompiled.h"
+#include "lsparallel.h"
+#include "lsrng.h"
+#include "lstrace.h"
 #include <assert.h>
+#include <dirent.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
 #include <string>
+#include <algorithm>
+
+/* ids of the symbols the loader and evaluator treat specially. these are
+   interned once so parsing and evaluation only compare integers */
+static const char *op_names[] = {
+  0, "+", "-", "*", "/", "<", ">", "<=", ">=", "=", "and", "or", "not"
+};
+
+static std::vector<char> operators;	/* symbol id -> op_* */
+static int sym_axiom, sym_production, sym_stochastic_production;
+static int sym_lt, sym_gt;
+
+static void intern_symbols() {
+  for (int i = op_add; i <= op_not; i++) {
+    int s = sxp_intern(op_names[i]);
+    if (s >= (int) operators.size())
+      operators.resize(s + 1, op_none);
+    operators[s] = i;
+  }
 
-static FILE *reading = 0;
+  sym_axiom = sxp_intern("axiom");
+  sym_production = sxp_intern("production");
+  sym_stochastic_production = sxp_intern("stochastic-production");
+  sym_lt = sxp_intern("<");
+  sym_gt = sxp_intern(">");
+}
 
-static int reader() {
-  if (!reading)
-    return -1;
-  int c = fgetc(reading);
-  if (c == EOF) {
-    fclose(reading);
-    return -1;
-  } return c;
+/* once, however many threads are loading */
+static pthread_once_t symbols_once = PTHREAD_ONCE_INIT;
+
+static void init_symbols() {
+  pthread_once(&symbols_once, intern_symbols);
 }
 
+int ls_operator(int sym) {
+  return sym < (int) operators.size() ? operators[sym] : (int) op_none;
+}
+
+/* every element of an expansion is a list */
+static bool expansion_lists(sxp *def) {
+  for (; def; def = def->next)
+    if (def->type != ty_sxp)
+      return false;
+  return true;
+}
+
+/* 0 if def isn't a probability followed by an expansion */
 stochastic_expansion *parse_stochastic_expansion(sxp *def) {
-  assert(def->type == ty_integer || def->type == ty_float);
+  if (!def || (def->type != ty_integer && def->type != ty_float)
+      || !expansion_lists(def->next))
+    return 0;
   
   stochastic_expansion *e = new stochastic_expansion;
   e->probability = def->type == ty_float ? def->R : def->Z;
   e->expansion = def->next;
+  e->code = 0;			/* compiled once optimized */
+  return e;
+}
 
-  def = def->next;
-  while (def) {
-    sxp_assert_type(def, ty_sxp);
-    def = def->next;
-  } return e;
+/* number the formal parameters in the order matching sees them, so
+   bindings are slot indices instead of names */
+static bool pattern_slots(production *p, sxp *pattern) {
+  std::vector<int> slots(1, -1);	/* the module name */
+
+  if (!pattern || pattern->type != ty_symbol) {
+    fprintf(stderr, "parse_production: a pattern module has no name\n");
+    return false;
+  }
+  for (sxp *t = pattern->next; t; t = t->next) {
+    int slot = -1;
+    if (t->type == ty_symbol) {
+      for (slot = 0; slot < p->params.size(); slot++)
+	if (p->params[slot] == t->sym)
+	  break;
+      if (slot == p->params.size()) {
+	if (slot == LS_MAX_SLOTS) {
+	  fprintf(stderr, "parse_production: more than %d parameters\n", LS_MAX_SLOTS);
+	  return false;
+	} p->params.push_back(t->sym);
+      }
+    } slots.push_back(slot);
+  } p->slots.push_back(slots);
+  return true;
 }
 
-/* pass in pointer to production expression */
-production *parse_production(sxp *def, bool stochastic) {
-  assert(sxp_length(def) >= 2); /* allow empty expansion */
-  sxp_assert_type(def, ty_sxp);
+static bool assign_slots(production *p) {
+  for (int i = 0; i < p->left.size(); i++)
+    if (!pattern_slots(p, p->left[i]))
+      return false;
+  if (!pattern_slots(p, p->center))
+    return false;
+  for (int i = 0; i < p->right.size(); i++)
+    if (!pattern_slots(p, p->right[i]))
+      return false;
+  return true;
+}
+
+static void free_production(production *p) {
+  delete p->test;
+  for (int i = 0; i < p->expansion.size(); i++) {
+    delete p->expansion[i]->code;
+    delete p->expansion[i];
+  } delete p;
+}
 
+static production *malformed(production *p, const char *why) {
+  fprintf(stderr, "parse_production: %s\n", why);
+  free_production(p);
+  return 0;
+}
+
+/* pass in pointer to production expression. 0, with a message, if it
+   is malformed */
+production *parse_production(sxp *def, bool stochastic) {
   production *p = new production;
+  p->test = 0;
+  if (sxp_length(def) < 2 || def->type != ty_sxp) /* allow empty expansion */
+    return malformed(p, "malformed production");
 
   /* parse the matching pattern */
   sxp *t = def->down;
@@ -51,24 +145,21 @@ production *parse_production(sxp *def, bool stochastic) {
       ++seglen;
       break;
     case ty_symbol:
-      if (!strcmp(t->symbol, "<") && units == 0) {
+      if (t->sym == sym_lt && units == 0) {
 	p->left = accum;
 	accum = std::vector<sxp *>();
 	seglen = 0;
 	++units;
-      } else if (!strcmp(t->symbol, ">") && units == 1) {
-	if (seglen != 1) {
-	  fprintf(stderr, "parse_production: center must be 1 symbol long\n");
-	  exit(-1);
-	} 
+      } else if (t->sym == sym_gt && units == 1) {
+	if (seglen != 1)
+	  return malformed(p, "center must be 1 symbol long");
 	p->center = accum[0];
 	accum = std::vector<sxp *>();
 	seglen = 0;
 	++units;
       } break;
     default:
-      fprintf(stderr, "parse_production: malformed production\n");
-      exit(-1);
+      return malformed(p, "malformed production");
     } t = t->next;
   }
   
@@ -78,26 +169,28 @@ production *parse_production(sxp *def, bool stochastic) {
     p->center = accum[0];
   } else if (units == 2) {
     p->right = accum;
-  } else {
-    fprintf(stderr, "parse_production: malformed production\n");
-    exit(-1);
-  }
+  } else
+    return malformed(p, "malformed production");
+  if (!assign_slots(p))
+    return malformed(p, "malformed pattern");
+  p->symbol = p->center->sym;
 
   def = def->next;
-  sxp_assert_type(def, ty_sxp);
+  if (def->type != ty_sxp)
+    return malformed(p, "the condition isn't a list");
   p->condition = def->down;
   def = def->next;
 
   if (stochastic) {
-    if (!def) {
-      fprintf(stderr, "parse_production: stochastic production has no expansion\n");
-      exit(-1);
-    }
+    if (!def)
+      return malformed(p, "stochastic production has no expansion");
 
     float prob = 0;
     while (def) {
-      sxp_assert_type(def, ty_sxp);
-      stochastic_expansion *r = parse_stochastic_expansion(def->down);
+      stochastic_expansion *r = def->type == ty_sxp
+	? parse_stochastic_expansion(def->down) : 0;
+      if (!r)
+	return malformed(p, "malformed stochastic expansion");
       p->expansion.push_back(r);
       def = def->next;
       prob += r->probability;
@@ -109,43 +202,193 @@ production *parse_production(sxp *def, bool stochastic) {
     stochastic_expansion *r = new stochastic_expansion;
     r->probability = 1;
     r->expansion = def;
+    r->code = 0;
     p->expansion.push_back(r);
-    while (def) {
-      sxp_assert_type(def, ty_sxp);
-      def = def->next;
-    } 
+    if (!expansion_lists(def))
+      return malformed(p, "malformed expansion");
   }
 
+  /* the condition and expansions are compiled as the optimizer leaves
+     them */
+  ls_optimize(p);
+  p->test = p->condition ? vm_compile_condition(p->condition, p->params) : 0;
+  for (int i = 0; i < p->expansion.size(); i++) {
+    stochastic_expansion *r = p->expansion[i];
+    r->code = vm_compile_expansion(r->expansion, p->params);
+  }
+
+  double sum = 0;
+  for (int i = 0; i < p->expansion.size(); i++)
+    p->cumulative.push_back(sum += p->expansion[i]->probability);
+  p->profile.fired.assign(p->expansion.size() + 1, 0);
   return p;
 }
 
+/* build an lsystem from its parsed definition. name is for messages. 0
+   if the definition is malformed, and the grammar arena is freed */
+static lsystem *load(sxp_arena *grammar, sxp *def, const char *name) {
+  ls_span span;
+  ls_span_begin(&span, ls_trace_phases, "load", 0, 0);
+  sxp *definition = def, *axiom = 0;
+  std::vector<production *> productions;
+
+  /* what the optimizer builds lives with the definition */
+  sxp_arena *old = sxp_set_arena(grammar);
+  for (; def; def = def->next) {
+    if (def->type != ty_sxp || !def->down || def->down->type != ty_symbol)
+      break;
+    int s = def->down->sym;
+    production *p = 0;
+
+    if (s == sym_axiom)
+      axiom = def->down->next;
+    else if (s == sym_production)
+      p = parse_production(def->down->next, false);
+    else if (s == sym_stochastic_production)
+      p = parse_production(def->down->next, true);
+    if (p)
+      productions.push_back(p);
+    else if (s != sym_axiom)
+      break;
+  } sxp_set_arena(old);
+
+  if (def) {
+    fprintf(stderr, "ls_load: %s is malformed\n", name);
+    for (int i = 0; i < productions.size(); i++)
+      free_production(productions[i]);
+    sxp_arena_free(grammar);
+    ls_span_end(&span);
+    return 0;
+  }
+
+  lsystem *ls = new lsystem;
+  ls->grammar = grammar;
+  ls->definition = definition;
+  ls->axiom = axiom;
+  ls->productions = productions;
+  ls->reference_eval = false;
+  ls->compiled = 0;
+  ls->arena[0] = sxp_arena_new();
+  ls->arena[1] = sxp_arena_new();
+  ls->scratch = sxp_arena_new();
+  ls->pool = 0;
+  ls->seed = 0;
+  ls->generation = 0;
+  ls->memory_limit = 0;
+  ls->over_budget = false;
+
+  ls_build_dispatch(ls);
+  ls_span_end(&span);
+  return ls;
+}
+
 /* load up lsystem definition from file */
 lsystem *ls_load(char *file) {
-  reading = fopen(file, "rb");
-  if (!reading) {
+  /* the definition lives as long as the lsystem, so it is parsed into
+     an arena of its own rather than node by node with malloc */
+  sxp_arena *grammar = sxp_arena_new();
+  sxp_arena *old = sxp_set_arena(grammar);
+  sxp *def;
+  init_symbols();
+  ls_span span;
+  ls_span_begin(&span, ls_trace_phases, "parse", 0, 0);
+  int loaded = sxp_load(file, &def);
+  ls_span_end(&span);
+  sxp_set_arena(old);
+  if (!loaded) {
     fprintf(stderr, "couldn't read lsystem definition from %s\n", file);
+    sxp_arena_free(grammar);
     return 0;
-  } set_reader(reader);
-  
-  lsystem *ls = new lsystem;
-  sxp *def = sxp_next();
-
-  while (def) {
-    sxp_assert_type(def, ty_sxp);
-    sxp_assert_type(def->down, ty_symbol);
-    char *s = def->down->symbol;
-
-    if (!strcmp(s, "axiom"))
-      ls->axiom = def->down->next;
-    else if (!strcmp(s, "production"))
-      ls->productions.push_back(parse_production(def->down->next, false));
-    else if (!strcmp(s, "stochastic-production"))
-      ls->productions.push_back(parse_production(def->down->next, true));
-    else {
-      fprintf(stderr, "ls_load: %s is malformed\n", file);
-      exit(-1);
-    } def = def->next;
-  } return ls;
+  }
+  return load(grammar, def, file);
+}
+
+lsystem *ls_load_from_buffer(const char *text, size_t len) {
+  sxp_arena *grammar = sxp_arena_new();
+  sxp_arena *old = sxp_set_arena(grammar);
+  init_symbols();
+  ls_span span;
+  ls_span_begin(&span, ls_trace_phases, "parse", 0, 0);
+  sxp *def;
+  int parsed = sxp_parse(text, len, &def);
+  ls_span_end(&span);
+  sxp_set_arena(old);
+  if (!parsed) {
+    fprintf(stderr, "couldn't parse lsystem definition from buffer\n");
+    sxp_arena_free(grammar);
+    return 0;
+  }
+  return load(grammar, def, "buffer");
+}
+
+typedef struct t_loading {
+  char **paths;
+  lsystem **out;
+} loading;
+
+static void load_task(void *ctx, int task, int) {
+  loading *l = (loading *) ctx;
+  l->out[task] = ls_load(l->paths[task]);
+}
+
+/* loading shares nothing between grammars but the symbol table, so
+   the files are handed out to the threads one at a time */
+int ls_load_many(char **paths, int n, lsystem **out, int threads) {
+  loading l = {paths, out};
+  ls_pool *pool = ls_pool_new(threads < n ? threads : n);
+  ls_pool_run(pool, n, load_task, &l);
+  ls_pool_free(pool);
+
+  int loaded = 0;
+  for (int i = 0; i < n; i++)
+    if (out[i])
+      ++loaded;
+  return loaded;
+}
+
+int ls_load_directory(const char *dir, std::vector<std::string> &paths,
+		      std::vector<lsystem *> &out, int threads) {
+  DIR *d = opendir(dir);
+  if (!d)
+    return -1;
+
+  paths.clear();
+  struct dirent *e;
+  while ((e = readdir(d))) {
+    size_t len = strlen(e->d_name);
+    if (len > 3 && !strcmp(e->d_name + len - 3, ".ls"))
+      paths.push_back(std::string(dir) + "/" + e->d_name);
+  } closedir(d);
+  std::sort(paths.begin(), paths.end());
+
+  std::vector<char *> names;
+  for (int i = 0; i < paths.size(); i++)
+    names.push_back((char *) paths[i].c_str());
+  out.assign(paths.size(), 0);
+  if (paths.empty())
+    return 0;
+  return ls_load_many(&names[0], names.size(), &out[0], threads);
+}
+
+/* group productions by the symbol they rewrite, so a module only tries
+   the productions that could match it. dead ones can't match anything */
+void ls_build_dispatch(lsystem *ls) {
+  ls->dispatch.clear();
+  ls->rewritable.clear();
+  ls->has_context = false;
+  for (int i = 0; i < ls->productions.size(); i++) {
+    production *p = ls->productions[i];
+    if (p->dead)
+      continue;
+    if (!p->left.empty() || !p->right.empty())
+      ls->has_context = true;
+    if (p->symbol >= ls->rewritable.size())
+      ls->rewritable.resize(p->symbol + 1, false);
+    ls->rewritable[p->symbol] = true;
+    if (p->symbol >= ls->dispatch.size())
+      ls->dispatch.resize(p->symbol + 1);
+    ls->dispatch[p->symbol].push_back(p);
+  }
 }
 
 static void dump_production(production *p) {
@@ -190,6 +433,223 @@ void dump_lsystem(lsystem *ls) {
   printf("l-system axiom: "); sxp_print(ls->axiom); printf("\n");
 }
 
+/* memory */
+
+template <class T> static size_t vector_bytes(const std::vector<T> &v) {
+  return v.capacity() * sizeof(T);
+}
+
+static size_t string_bytes(const ls_string *s) {
+  return vector_bytes(s->symbol) + vector_bytes(s->start)
+    + vector_bytes(s->value) + vector_bytes(s->type);
+}
+
+size_t ls_memory_held(lsystem *ls) {
+  return sxp_arena_held(ls->arena[0]) + sxp_arena_held(ls->arena[1])
+    + sxp_arena_held(ls->scratch) + string_bytes(&ls->flat[0])
+    + string_bytes(&ls->flat[1]) + vector_bytes(ls->elements)
+    + vector_bytes(ls->brackets);
+}
+
+static size_t program_bytes(vm_program *p) {
+  return sizeof(*p) + vector_bytes(p->code) + vector_bytes(p->constants);
+}
+
+size_t ls_grammar_bytes(lsystem *ls) {
+  size_t n = sizeof(*ls) + sxp_arena_held(ls->grammar)
+    + vector_bytes(ls->productions) + vector_bytes(ls->dispatch)
+    + ls->rewritable.capacity() / 8;
+  for (int i = 0; i < ls->dispatch.size(); i++)
+    n += vector_bytes(ls->dispatch[i]);
+
+  for (int i = 0; i < ls->productions.size(); i++) {
+    production *p = ls->productions[i];
+    n += sizeof(*p) + vector_bytes(p->left) + vector_bytes(p->right)
+      + vector_bytes(p->params) + vector_bytes(p->slots)
+      + vector_bytes(p->expansion) + vector_bytes(p->cumulative)
+      + vector_bytes(p->profile.fired);
+    for (int k = 0; k < p->slots.size(); k++)
+      n += vector_bytes(p->slots[k]);
+    if (p->test)
+      n += program_bytes(p->test);
+    for (int k = 0; k < p->expansion.size(); k++) {
+      stochastic_expansion *x = p->expansion[k];
+      n += sizeof(*x);
+      if (x->code)
+	n += program_bytes(&x->code->prog) - sizeof(vm_program)
+	  + sizeof(*x->code) + vector_bytes(x->code->emit);
+    }
+  } return n;
+}
+
+bool ls_check_memory(lsystem *ls) {
+  if (ls->memory_limit && ls_memory_held(ls) > ls->memory_limit)
+    ls->over_budget = true;
+  return !ls->over_budget;
+}
+
+/* an entry of generation_memory; made is what the calling thread had
+   made before the generation */
+static void record_memory(lsystem *ls, const unsigned long long *made) {
+  sxp_memory m;
+  sxp_memory_stats(&m);
+  ls_memory g;
+  g.held = ls_memory_held(ls);
+  g.live = m.live;
+  g.peak = m.peak;
+  g.symbols = m.symbols;
+  for (int t = 0; t < 4; t++)
+    g.nodes[t] = m.made[t] - made[t];
+  ls->generation_memory.push_back(g);
+}
+
+static void nodes_made(unsigned long long *made) {
+  sxp_memory m;
+  sxp_memory_stats(&m);
+  memcpy(made, m.made, sizeof(m.made));
+}
+
+/* generation_memory as json */
+void dump_memory(lsystem *ls, FILE *f) {
+  fprintf(f, "{\"grammar_bytes\": %lu, \"memory_limit\": %lu,"
+	  " \"over_budget\": %s, \"generations\": [",
+	  (unsigned long) ls_grammar_bytes(ls),
+	  (unsigned long) ls->memory_limit,
+	  ls->over_budget ? "true" : "false");
+  for (int i = 0; i < ls->generation_memory.size(); i++) {
+    ls_memory *g = &ls->generation_memory[i];
+    fprintf(f, "%s\n  {\"generation\": %d, \"held\": %lu, \"live\": %lu,"
+	    " \"peak\": %lu, \"symbols\": %lu,\n   \"nodes\": {\"float\": %llu,"
+	    " \"integer\": %llu, \"symbol\": %llu, \"list\": %llu}}",
+	    i ? "," : "", i, (unsigned long) g->held, (unsigned long) g->live,
+	    (unsigned long) g->peak, (unsigned long) g->symbols,
+	    g->nodes[ty_float], g->nodes[ty_integer], g->nodes[ty_symbol],
+	    g->nodes[ty_sxp]);
+  }
+  fprintf(f, "\n]}\n");
+}
+
+/* json */
+
+static void json_name(FILE *f, int sym) {
+  fputc('"', f);
+  for (const char *c = sxp_symbol_name(sym); *c; c++) {
+    if (*c == '"' || *c == '\\')
+      fprintf(f, "\\%c", *c);
+    else if ((unsigned char) *c < 0x20)
+      fprintf(f, "\\u%04x", *c);
+    else
+      fputc(*c, f);
+  } fputc('"', f);
+}
+
+static void json_names(FILE *f, std::vector<sxp *> &rules) {
+  fputc('[', f);
+  for (int i = 0; i < rules.size(); i++) {
+    fprintf(f, i ? ", " : "");
+    json_name(f, rules[i]->sym);
+  } fputc(']', f);
+}
+
+/* the counters of every production, in declaration order, as json.
+   "profiled" is false if they weren't compiled in */
+void dump_profile(lsystem *ls, FILE *f) {
+#ifdef LS_PROFILE
+  fprintf(f, "{\"profiled\": true, \"productions\": [");
+#else
+  fprintf(f, "{\"profiled\": false, \"productions\": [");
+#endif
+  for (int i = 0; i < ls->productions.size(); i++) {
+    production *p = ls->productions[i];
+    ls_profile *c = &p->profile;
+    int n = p->expansion.size();
+
+    fprintf(f, "%s\n  {\"production\": %d, \"left\": ", i ? "," : "", i);
+    json_names(f, p->left);
+    fprintf(f, ", \"center\": ");
+    json_name(f, p->symbol);
+    fprintf(f, ", \"right\": ");
+    json_names(f, p->right);
+    fprintf(f, ",\n   \"attempts\": %llu, \"symbol_rejects\": %llu,"
+	    " \"param_rejects\": %llu,\n   \"conditions\": %llu,"
+	    " \"condition_seconds\": %.9f, \"condition_failures\": %llu,\n"
+	    "   \"fired\": [", c->attempts, c->symbol_rejects,
+	    c->param_rejects, c->conditions, c->condition_ns * 1e-9,
+	    c->condition_failures);
+    for (int k = 0; k < n; k++)
+      fprintf(f, "%s%llu", k ? ", " : "", c->fired[k]);
+    fprintf(f, "], \"dropped\": %llu, \"emitted\": %llu}",
+	    c->fired[n], c->emitted);
+  }
+  fprintf(f, "\n]}\n");
+}
+
+void ls_profile_reset(lsystem *ls) {
+  for (int i = 0; i < ls->productions.size(); i++) {
+    production *p = ls->productions[i];
+    ls_profile fresh;
+    fresh.fired.assign(p->expansion.size() + 1, 0);
+    p->profile = fresh;
+  }
+}
+
+/* what ls_optimize and the compiler did to each production. a
+   condition is "none" if it had none, "tested", or decided at load:
+   "always" true or "never", which leaves the production dead */
+void dump_optimization(lsystem *ls, FILE *f) {
+  int folded = 0, simplified = 0, shared = 0, dead = 0, unconditional = 0;
+  fprintf(f, "{\"productions\": [");
+  for (int i = 0; i < ls->productions.size(); i++) {
+    production *p = ls->productions[i];
+    int n = 0;
+    for (int k = 0; k < p->expansion.size(); k++)
+      if (p->expansion[k]->code)
+	n += p->expansion[k]->code->shared;
+
+    const char *condition = p->dead ? "never"
+      : p->unconditional ? "always" : p->condition ? "tested" : "none";
+    fprintf(f, "%s\n  {\"production\": %d, \"left\": ", i ? "," : "", i);
+    json_names(f, p->left);
+    fprintf(f, ", \"center\": ");
+    json_name(f, p->symbol);
+    fprintf(f, ", \"right\": ");
+    json_names(f, p->right);
+    fprintf(f, ",\n   \"condition\": \"%s\", \"folded\": %d,"
+	    " \"simplified\": %d, \"shared\": %d}", condition, p->folded,
+	    p->simplified, n);
+
+    folded += p->folded;
+    simplified += p->simplified;
+    shared += n;
+    dead += p->dead;
+    unconditional += p->unconditional;
+  }
+  fprintf(f, "\n],\n \"folded\": %d, \"simplified\": %d, \"shared\": %d,"
+	  " \"dead\": %d, \"unconditional\": %d}\n", folded, simplified,
+	  shared, dead, unconditional);
+}
+
+/* parameter lookup for the tree walker: a linear search over the
+   production's formal parameters */
+bool ls_env_lookup(env *e, int sym, double *v) {
+  std::vector<int> &params = e->p->params;
+  for (int i = 0; i < params.size(); i++) {
+    if (params[i] == sym) {
+      if (!(e->bound & LS_SLOT_BIT(i)))
+	return false;
+      *v = e->slot[i];
+      return true;
+    }
+  } return false;
+}
+
+static double ls_env_get(env *e, int sym) {
+  double v;
+  bool bound = ls_env_lookup(e, sym, &v);
+  assert(bound);
+  return v;
+}
+
 /* evaluate various operators */
 
 sxp *ls_eval_add(env *e, sxp *expr) {
@@ -214,8 +674,7 @@ sxp *ls_eval_add(env *e, sxp *expr) {
       break;
 
     case ty_symbol:
-      assert(e->find(expr->symbol) != e->end());
-      result += (*e)[expr->symbol];
+      result += ls_env_get(e, expr->sym);
       break;
     }
 
@@ -259,13 +718,11 @@ sxp *ls_eval_sub(env *e, sxp *expr) {
       break;
 
     case ty_symbol:
-      assert(e->find(expr->symbol) != e->end());
-
       if (!set) {
-	result = (*e)[expr->symbol];
+	result = ls_env_get(e, expr->sym);
 	set = true;
       } else
-	result -= (*e)[expr->symbol];
+	result -= ls_env_get(e, expr->sym);
       break;
     }
 
@@ -295,8 +752,7 @@ sxp *ls_eval_mul(env *e, sxp *expr) {
       break;
 
     case ty_symbol:
-      assert(e->find(expr->symbol) != e->end());
-      result *= (*e)[expr->symbol];
+      result *= ls_env_get(e, expr->sym);
       break;
     }
 
@@ -340,13 +796,11 @@ sxp *ls_eval_div(env *e, sxp *expr) {
       break;
 
     case ty_symbol:
-      assert(e->find(expr->symbol) != e->end());
-
       if (!set) {
-	result = (*e)[expr->symbol];
+	result = ls_env_get(e, expr->sym);
 	set = true;
       } else
-	result /= (*e)[expr->symbol];
+	result /= ls_env_get(e, expr->sym);
       break;
     }
 
@@ -369,8 +823,7 @@ sxp *ls_eval_eq(env *e, sxp *expr) {
     a = expr->R;
     break;
   case ty_symbol:
-    assert(e->find(expr->symbol) != e->end());
-    a = (*e)[expr->symbol];
+    a = ls_env_get(e, expr->sym);
     break;
   case ty_sxp:
     t = ls_eval_expr(e, expr->down);
@@ -388,8 +841,7 @@ sxp *ls_eval_eq(env *e, sxp *expr) {
     b = expr->R;
     break;
   case ty_symbol:
-    assert(e->find(expr->symbol) != e->end());
-    b = (*e)[expr->symbol];
+    b = ls_env_get(e, expr->sym);
     break;
   case ty_sxp:
     t = ls_eval_expr(e, expr->down);
@@ -416,8 +868,7 @@ sxp *ls_eval_lt(env *e, sxp *expr) {
     a = expr->R;
     break;
   case ty_symbol:
-    assert(e->find(expr->symbol) != e->end());
-    a = (*e)[expr->symbol];
+    a = ls_env_get(e, expr->sym);
     break;
   case ty_sxp:
     t = ls_eval_expr(e, expr->down);
@@ -435,8 +886,7 @@ sxp *ls_eval_lt(env *e, sxp *expr) {
     b = expr->R;
     break;
   case ty_symbol:
-    assert(e->find(expr->symbol) != e->end());
-    b = (*e)[expr->symbol];
+    b = ls_env_get(e, expr->sym);
     break;
   case ty_sxp:
     t = ls_eval_expr(e, expr->down);
@@ -463,8 +913,7 @@ sxp *ls_eval_gt(env *e, sxp *expr) {
     a = expr->R;
     break;
   case ty_symbol:
-    assert(e->find(expr->symbol) != e->end());
-    a = (*e)[expr->symbol];
+    a = ls_env_get(e, expr->sym);
     break;
   case ty_sxp:
     t = ls_eval_expr(e, expr->down);
@@ -482,8 +931,7 @@ sxp *ls_eval_gt(env *e, sxp *expr) {
     b = expr->R;
     break;
   case ty_symbol:
-    assert(e->find(expr->symbol) != e->end());
-    b = (*e)[expr->symbol];
+    b = ls_env_get(e, expr->sym);
     break;
   case ty_sxp:
     t = ls_eval_expr(e, expr->down);
@@ -511,8 +959,7 @@ sxp *ls_eval_lte(env *e, sxp *expr) {
     a = expr->R;
     break;
   case ty_symbol:
-    assert(e->find(expr->symbol) != e->end());
-    a = (*e)[expr->symbol];
+    a = ls_env_get(e, expr->sym);
     break;
   case ty_sxp:
     t = ls_eval_expr(e, expr->down);
@@ -530,8 +977,7 @@ sxp *ls_eval_lte(env *e, sxp *expr) {
     b = expr->R;
     break;
   case ty_symbol:
-    assert(e->find(expr->symbol) != e->end());
-    b = (*e)[expr->symbol];
+    b = ls_env_get(e, expr->sym);
     break;
   case ty_sxp:
     t = ls_eval_expr(e, expr->down);
@@ -558,8 +1004,7 @@ sxp *ls_eval_gte(env *e, sxp *expr) {
     a = expr->R;
     break;
   case ty_symbol:
-    assert(e->find(expr->symbol) != e->end());
-    a = (*e)[expr->symbol];
+    a = ls_env_get(e, expr->sym);
     break;
   case ty_sxp:
     t = ls_eval_expr(e, expr->down);
@@ -577,8 +1022,7 @@ sxp *ls_eval_gte(env *e, sxp *expr) {
     b = expr->R;
     break;
   case ty_symbol:
-    assert(e->find(expr->symbol) != e->end());
-    b = (*e)[expr->symbol];
+    b = ls_env_get(e, expr->sym);
     break;
   case ty_sxp:
     t = ls_eval_expr(e, expr->down);
@@ -614,8 +1058,7 @@ sxp *ls_eval_and(env *e, sxp *expr) {
       break;
 
     case ty_symbol:
-      assert(e->find(expr->symbol) != e->end());
-      if((*e)[expr->symbol] == 0)
+      if(ls_env_get(e, expr->sym) == 0)
 	return sxp_makefloat(0, 0);
       break;
     }
@@ -648,8 +1091,7 @@ sxp *ls_eval_or(env *e, sxp *expr) {
       break;
 
     case ty_symbol:
-      assert(e->find(expr->symbol) != e->end());
-      if((*e)[expr->symbol] == 1)
+      if(ls_env_get(e, expr->sym) == 1)
 	return sxp_makefloat(1, 0);
       break;
     }
@@ -672,8 +1114,7 @@ sxp *ls_eval_not(env *e, sxp *expr) {
     a = expr->R;
     break;
   case ty_symbol:
-    assert(e->find(expr->symbol) != e->end());
-    a = (*e)[expr->symbol];
+    a = ls_env_get(e, expr->sym);
     break;
   case ty_sxp:
     t = ls_eval_expr(e, expr->down);
@@ -694,32 +1135,33 @@ sxp *ls_eval_expr(env *e, sxp *expr) {
 		       ls_eval_expr(e, expr->next));
 
   sxp_assert_type(expr, ty_symbol);
-  char *s = expr->symbol;
+  int s = expr->sym;
 
   /* operators return a value wrapped in a sxp node */
-  if (!strcmp(s, "+")) {
+  switch (ls_operator(s)) {
+  case op_add:
     return ls_eval_add(e, expr);
-  } else if (!strcmp(s, "-")) {
+  case op_sub:
     return ls_eval_sub(e, expr);
-  } else if (!strcmp(s, "*")) {
+  case op_mul:
     return ls_eval_mul(e, expr);
-  } else if (!strcmp(s, "/")) {
+  case op_div:
     return ls_eval_div(e, expr);
-  } else if (!strcmp(s, "<")) {
+  case op_lt:
     return ls_eval_lt(e, expr);
-  } else if (!strcmp(s, ">")) {
+  case op_gt:
     return ls_eval_gt(e, expr);
-  } else if (!strcmp(s, "<=")) {
+  case op_lte:
     return ls_eval_lte(e, expr);
-  } else if (!strcmp(s, ">=")) {
+  case op_gte:
     return ls_eval_gte(e, expr);
-  } else if (!strcmp(s, "=")) {
+  case op_eq:
     return ls_eval_eq(e, expr);
-  } else if (!strcmp(s, "and")) {
+  case op_and:
     return ls_eval_and(e, expr);
-  } else if (!strcmp(s, "or")) {
+  case op_or:
     return ls_eval_or(e, expr);
-  } else if (!strcmp(s, "not")) {
+  case op_not:
     return ls_eval_not(e, expr);
   }
 
@@ -727,17 +1169,18 @@ sxp *ls_eval_expr(env *e, sxp *expr) {
      to be an alphabet symbol. the remainder of the symbols in the expression
      are evaluated */
   
-  sxp *rv, *nv = sxp_makesymbol(s, 0);
+  sxp *rv, *nv = sxp_makesym(s, 0);
   rv = nv;
   
   expr = expr->next;
   while (expr) {
     if (expr->type == ty_symbol) {
-      /* symbolic types are substituted with a value from the map if possible */
-      if (e->find(expr->symbol) != e->end())
-	nv->next = sxp_makefloat((*e)[expr->symbol], 0);
+      /* symbolic types are substituted with a bound value if possible */
+      double v;
+      if (ls_env_lookup(e, expr->sym, &v))
+	nv->next = sxp_makefloat(v, 0);
       else 
-	nv->next = sxp_makesymbol(expr->symbol, 0);
+	nv->next = sxp_makesym(expr->sym, 0);
     } else if (expr->type == ty_sxp) {
       /* eval_expr will either return an evaluated subexpression or a float */
       sxp *t = ls_eval_expr(e, expr->down);
@@ -761,7 +1204,10 @@ sxp *ls_eval_expr(env *e, sxp *expr) {
   return rv;
 }
 
-bool attempt_matcher(env *e, sxp *rule, sxp *src) {
+/* bindings of formal parameters live in slots numbered by
+   parse_production. slot[] runs parallel to the rule list: each node's
+   slot, or -1 for the module name */
+bool attempt_matcher(env *e, sxp *rule, const int *slot, sxp *src) {
   if (rule == 0 && src == 0)
     return true;
   if (rule == 0 || src == 0)
@@ -795,204 +1241,691 @@ bool attempt_matcher(env *e, sxp *rule, sxp *src) {
   case ty_symbol:
     switch(src->type) {
     case ty_symbol:
-      if (strcmp(rule->symbol, src->symbol))
+      if (rule->sym != src->sym)
 	return false;
       break;
     case ty_integer:
-      if (e->find(rule->symbol) != e->end()) {
-	if ((*e)[rule->symbol] != src->Z)
+      if (e->bound & LS_SLOT_BIT(*slot)) {
+	if (e->slot[*slot] != src->Z)
 	  return false;
-      } else
-	(*e)[rule->symbol] = src->Z;
-      break;
+      } else {
+	e->slot[*slot] = src->Z;
+	e->bound |= LS_SLOT_BIT(*slot);
+      } break;
     case ty_float:
-      if (e->find(rule->symbol) != e->end()) {
-	if ((*e)[rule->symbol] != src->R)
+      if (e->bound & LS_SLOT_BIT(*slot)) {
+	if (e->slot[*slot] != src->R)
 	  return false;
-      } else
-	(*e)[rule->symbol] = src->R;
-      break;
+      } else {
+	e->slot[*slot] = src->R;
+	e->bound |= LS_SLOT_BIT(*slot);
+      } break;
     } break;
   }
 
-  return attempt_matcher(e, rule->next, src->next);
+  return attempt_matcher(e, rule->next, slot + 1, src->next);
 }
 
 bool attempt_match_first(sxp *rule, sxp *src) {
   sxp_assert_type(rule, ty_symbol);
   sxp_assert_type(src, ty_symbol);
 
-  if (!strcmp(rule->symbol, src->symbol))
-    return true;
-  return false;
+  return rule->sym == src->sym;
 }
 
-env *attempt_match(production *p, std::vector<sxp *> &in, int pos) {
-  env *e = new env;
-  int idx = pos - p->left.size();
-  
-  for (int i = 0; i < p->left.size(); i++) {
-    if (!attempt_match_first(p->left[i], in[idx])
-	|| !attempt_matcher(e, p->left[i], in[idx])) {
-      delete e;
-      return 0;
-    } ++idx; 
+/* one module of a pattern against one of the string, counting why it
+   doesn't match */
+static bool match_module(env *e, sxp *rule, const int *slot, sxp *src) {
+  if (!attempt_match_first(rule, src)) {
+    LS_COUNT(e->p, symbol_rejects, 1);
+    return false;
   }
+  if (!attempt_matcher(e, rule, slot, src)) {
+    LS_COUNT(e->p, param_rejects, 1);
+    return false;
+  } return true;
+}
 
-  if (!attempt_match_first(p->center, in[idx])
-      || !attempt_matcher(e, p->center, in[idx])) {
-    delete e;
-    return 0;
-  } ++idx;
+/* context. br is the bracket table of the whole string (see
+   ls_index_brackets), so the neighbours work for either representation.
+   as in ABOP, context skips over whole branches, a module's left context
+   carries on from the start of its branch into the parent, and its right
+   context ends with the branch */
+
+static int left_neighbour(const std::vector<int> &br, int i) {
+  while (--i >= 0) {
+    if (br[i] < 0)
+      return i;
+    if (br[i] < i)
+      i = br[i];		/* a branch: go on before it */
+  } return -1;
+}
 
-  for (int i = 0; i < p->right.size(); i++) {
-    if (!attempt_match_first(p->right[i], in[idx])
-	|| !attempt_matcher(e, p->right[i], in[idx])) {
-      delete e;
-      return 0;
-    } ++idx;
-  } 
+static int right_neighbour(const std::vector<int> &br, int i) {
+  int n = br.size();
+  while (++i < n) {
+    if (br[i] < 0)
+      return i;
+    if (br[i] < i)
+      return -1;		/* the end of i's branch */
+    i = br[i];
+  } return -1;
+}
 
-  return e;
+/* bind the production's parameters into e, which the caller owns. in
+   is the whole string, 0 where there are brackets */
+bool attempt_match(production *p, std::vector<sxp *> &in,
+		   const std::vector<int> &br, int pos, env *e) {
+  int nleft = p->left.size(), nright = p->right.size();
+  int j = pos, k = nleft;
+  LS_COUNT(p, attempts, 1);
+
+  /* the left context, nearest first, on the walk back toward the root;
+     walking right again couldn't get back into the center's branch */
+  e->p = p;
+  e->bound = 0;
+  for (int n = nleft - 1; n >= 0; n--) {
+    if ((j = left_neighbour(br, j)) < 0) {
+      LS_COUNT(p, symbol_rejects, 1);
+      return false;
+    }
+    if (!match_module(e, p->left[n], &p->slots[n][0], in[j]))
+      return false;
+  }
+
+  if (!match_module(e, p->center, &p->slots[k++][0], in[pos]))
+    return false;
+
+  j = pos;
+  for (int n = 0; n < nright; n++, k++) {
+    if ((j = right_neighbour(br, j)) < 0) {
+      LS_COUNT(p, symbol_rejects, 1);
+      return false;
+    }
+    if (!match_module(e, p->right[n], &p->slots[k][0], in[j]))
+      return false;
+  } return true;
 }
 
-sxp *ls_apply(lsystem *ls, sxp *state) {
-  std::vector<sxp *> input;
-  std::vector<sxp *> output;
-  
-  sxp *start = state;
-  while (state) {
-    sxp_assert_type(state, ty_sxp);
-    /* skip branches when matching */
-    if (state->down->type != ty_sxp)
-      input.push_back(state->down);
-    state = state->next;
-  }
-
-  int sz = input.size();
-  for (int i = 0; i < sz; i++) {
-    bool applied_production = false;
-    std::vector<production *>::iterator j = ls->productions.begin();
-    while (j != ls->productions.end() && !applied_production) {
-      production *p = *j;
-      
+static bool test_condition(lsystem *ls, production *p, env *e) {
+  if (p->test && !ls->reference_eval)
+    return vm_test(p->test, e);
+
+  sxp *test = ls_eval_expr(e, p->condition);
+  assert(test->type == ty_float || test->type == ty_integer);
+  switch (test->type) {
+  case ty_float:
+    return test->R > 0;
+  case ty_integer:
+    return test->Z > 0;
+  } return false;
+}
+
+#ifdef LS_PROFILE
+static unsigned long long profile_ns() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+#endif
+
+bool ls_test_condition(lsystem *ls, production *p, env *e) {
+  if (!p->condition)
+    return true; /* empty condition */
+#ifdef LS_PROFILE
+  unsigned long long start = profile_ns();
+  bool pass = test_condition(ls, p, e);
+  LS_COUNT(p, condition_ns, profile_ns() - start);
+  LS_COUNT(p, conditions, 1);
+  if (!pass)
+    LS_COUNT(p, condition_failures, 1);
+  return pass;
+#else
+  return test_condition(ls, p, e);
+#endif
+}
+
+/* figure out which expansion p applies to the module at position of
+   the current generation, 0 when the draw falls past the last
+   probability (the module is then deleted) */
+stochastic_expansion *ls_select_expansion(lsystem *ls, production *p,
+					  unsigned int position) {
+  std::vector<double> &sum = p->cumulative;
+
+  /* a plain production always takes its one expansion; don't draw */
+  if (sum.size() == 1 && sum[0] >= 1) {
+    LS_COUNT(p, fired[0], 1);
+    return p->expansion[0];
+  }
+
+  double prob = ls_rng_uniform(ls->seed, ls->generation, position);
+  int k = std::upper_bound(sum.begin(), sum.end(), prob) - sum.begin();
+  LS_COUNT(p, fired[k], 1);
+  return k < sum.size() ? p->expansion[k] : 0;
+}
+
+void ls_seed(lsystem *ls, unsigned long long seed) {
+  ls->seed = seed;
+  ls->generation = 0;
+}
+
+/* rewrite flat strings with a pool of threads; 1 goes back to the
+   sequential rewriter */
+void ls_set_threads(lsystem *ls, int threads) {
+  if (ls->pool)
+    ls_pool_free(ls->pool);
+  ls->pool = threads > 1 ? ls_pool_new(threads) : 0;
+}
+
+#ifdef LS_PROFILE
+/* modules in a list of string elements, those in its branches included */
+static unsigned long long count_modules(sxp *s) {
+  unsigned long long n = 0;
+  for (; s; s = s->next)
+    n += !s->down || s->down->type == ty_sxp ? count_modules(s->down) : 1;
+  return n;
+}
+#endif
+
+/* rewrite module i of the string indexed in ls->elements. i is also the
+   position the module draws with. returns the list of string elements
+   it becomes */
+static sxp *rewrite(lsystem *ls, int i, env *e) {
+  std::vector<sxp *> &input = ls->elements;
+  int sym = input[i]->sym;
+
+  /* symbols nothing rewrites skip matching altogether */
+  if (sym < ls->dispatch.size()) {
+    std::vector<production *> &candidates = ls->dispatch[sym];
+    for (int j = 0; j < candidates.size(); j++) {
+      production *p = candidates[j];
+
       /* can this production apply? */
-      if (p->left.size() <= i && i+1+p->right.size() <= sz) {
-	env *e = attempt_match(p, input, i);
-	if (e) {
-	  /* test condition */
-	  sxp *test = p->condition ? ls_eval_expr(e, p->condition) : 0;
-	  bool matches = false;
-	  if (test) {
-	    assert(test->type == ty_float || test->type == ty_integer);
-	    switch (test->type) {
-	    case ty_float:
-	      if (test->R > 0)
-		matches = true;
-	      break;
-	    case ty_integer:
-	      if (test->Z > 0)
-		matches = true;
-	      break;
-	    }
-	  } else
-	    matches = true; /* empty condition */
-
-	  if (matches) {
-	    double prob = (double) (rand() % 1000000) / 1000000.0;
-	    double sum = 0;
-
-	    /* figure out which expansion to apply */
-	    sxp *r = 0;
-	    std::vector<stochastic_expansion *>::iterator k = p->expansion.begin();
-	    while (k != p->expansion.end()) {
-	      stochastic_expansion *exp = *k;
-	      sum += exp->probability;
-	      if (prob < sum) {
-		r = exp->expansion;
-		break;
-	      } ++k;
-	    }
-
-	    /* compute expansion */
-	    sxp *o = 0, *s = 0;
-	    while (r) {
-	      if (o) {
-		o->next = sxp_makesxp(ls_eval_expr(e, r->down), 0);
-		o = o->next;
-	      } else {
-		o = sxp_makesxp(ls_eval_expr(e, r->down), 0);
-		s = o;
-	      }
-	      r = r->next;
-	    }
-	    
-	    output.push_back(s);
-	    applied_production = true;
-	  } 
-
-	  delete e;
+      if (!attempt_match(p, input, ls->brackets, i, e)
+	  || !ls_test_condition(ls, p, e))
+	continue;
+
+      stochastic_expansion *x = ls_select_expansion(ls, p, i);
+      if (!x)
+	return 0;
+
+      /* compute expansion */
+      ls_span span;
+      ls_span_begin(&span, ls_trace_modules, "expand", 0, 0);
+      sxp *s = 0, **tail = &s;
+      if (!ls->reference_eval)
+	s = vm_expand(x->code, e);
+      else {
+	for (sxp *r = x->expansion; r; r = r->next) {
+	  *tail = sxp_makesxp(ls_eval_expr(e, r->down), 0);
+	  tail = &(*tail)->next;
 	}
-      } ++j;
+      }
+      ls_span_end(&span);
+      LS_COUNT(p, emitted, count_modules(s));
+      return s;
+    }
+  }
+
+  /* if no productions applied, preserve input. it is copied since the
+     previous generation's storage is released once this one is built */
+  return sxp_makesxp(sxp_copy(input[i]), 0);
+}
+
+/* one entry per module of state, and per bracket of its branches, as
+   the flat form of the string would have them. brackets are 0 in
+   ls->elements and ls->brackets matches them up */
+static void index_elements(lsystem *ls, sxp *state) {
+  std::vector<sxp *> &input = ls->elements;
+  std::vector<int> &br = ls->brackets;
+  std::vector<sxp *> resume;	/* where each open branch continues */
+  std::vector<int> open;
+
+  input.clear();
+  br.clear();
+  for (sxp *t = state;;) {
+    if (!t) {
+      if (resume.empty())
+	break;
+      br[open.back()] = br.size();
+      br.push_back(open.back());
+      input.push_back(0);
+      open.pop_back();
+      t = resume.back();
+      resume.pop_back();
+      continue;
     }
 
-    /* if no productions applied, preserve input */
-    if (!applied_production)
-      output.push_back(sxp_makesxp(input[i], 0));
+    sxp_assert_type(t, ty_sxp);
+    if (!t->down || t->down->type == ty_sxp) {
+      open.push_back(br.size());
+      br.push_back(-1);
+      input.push_back(0);
+      resume.push_back(t->next);
+      t = t->down;
+      continue;
+    }
+
+    br.push_back(-1);
+    input.push_back(t->down);
+    t = t->next;
   }
+}
 
-  if (output.size() == 0)
+/* a single pass over the whole string, so context can be matched across
+   branches; the output's branches are rebuilt as their brackets go by */
+sxp *ls_apply(lsystem *ls, sxp *state) {
+  ls_span span, phase;
+  ls_span_begin(&span, ls_trace_phases, "generation", "generation",
+		ls->generation);
+  ls_span_begin(&phase, ls_trace_phases, "flatten", 0, 0);
+  index_elements(ls, state);
+  ls_span_end(&phase);
+
+  env frame;
+  std::vector<sxp **> resume;
+  std::vector<ls_span> branches;	/* the open ones, if they're traced */
+  sxp *s = 0, **tail = &s;
+  int n = ls->elements.size();
+  ls_span_begin(&phase, ls_trace_phases, "match", 0, 0);
+  for (int i = 0; i < n; i++) {
+    if (ls->memory_limit && i % LS_MEMORY_CHECK == 0 && !ls_check_memory(ls))
+      break;
+    int match = ls->brackets[i];
+    if (match > i) {
+      sxp *b = sxp_makesxp(0, 0);
+      *tail = b;
+      resume.push_back(&b->next);
+      tail = &b->down;
+      if (ls_trace_detail >= ls_trace_modules) {
+	branches.resize(resume.size());
+	ls_span_begin(&branches.back(), ls_trace_modules, "branch",
+		      "depth", resume.size());
+      } continue;
+    } else if (match >= 0) {
+      if (branches.size() == resume.size()) {
+	ls_span_end(&branches.back());
+	branches.pop_back();
+      }
+      tail = resume.back();
+      resume.pop_back();
+      continue;
+    }
+
+    *tail = rewrite(ls, i, &frame);
+    while (*tail)
+      tail = &(*tail)->next;
+  } ls_span_end(&phase);
+  ls_span_end(&span);
+  if (ls->over_budget)
     return 0;
 
-  /* stitch together output */
-  sxp *o = 0, *s = 0;
-  while (start && start->down->type == ty_sxp) {
-    if (o == 0) {
-      o = sxp_makesxp(ls_apply(ls, start->down), 0);
-      s = o;
-    } else {
-      o->next = sxp_makesxp(ls_apply(ls, start->down),0);
-      o = o->next;
-    } start = start->next;
-  }
+  ++ls->generation;
+  return s;
+}
 
-  if (!o) {
-    o = output[0];
-    s = o;
-  } else
-    o->next = output[0];
-  while (o && o->next)
-    o = o->next;
-  start = start->next;
-
-  for (int i = 1; i < output.size(); i++) {
-    while (start && start->down->type == ty_sxp) {
-      if (o == 0) {
-	o = sxp_makesxp(ls_apply(ls, start->down), 0);
-	s = o;
+/* flat strings */
+
+/* bind the parameters of module i of a flat string to those of rule,
+   which starts at the first parameter */
+static bool bind_params(env *e, sxp *rule, const int *slot,
+			const ls_string *s, int i) {
+  unsigned int k = s->start[i], end = s->start[i + 1];
+  for (; rule; rule = rule->next, ++slot, ++k) {
+    if (k == end)
+      return false;
+    double v = s->value[k];
+
+    switch (rule->type) {
+    case ty_integer:
+    case ty_float:
+      /* attempt_matcher never matches literal parameters either */
+      return false;
+    case ty_symbol:
+      if (s->type[k] == ty_symbol) {
+	if (rule->sym != (int) v)
+	  return false;
+      } else if (e->bound & LS_SLOT_BIT(*slot)) {
+	if (e->slot[*slot] != v)
+	  return false;
       } else {
-	o->next = sxp_makesxp(ls_apply(ls, start->down),0);
-	o = o->next;
-      } start = start->next;
+	e->slot[*slot] = v;
+	e->bound |= LS_SLOT_BIT(*slot);
+      } break;
     }
+  } return k == end;
+}
 
-    if (!o) {
-      o = output[i];
-      s = o;
-    } else
-      o->next = output[i];
-    while (o && o->next)
-      o = o->next;
-    start = start->next;
-  } return s;
+/* attempt_matcher for module i of a flat string */
+bool ls_match_params(env *e, sxp *rule, const int *slot,
+		     const ls_string *s, int i) {
+  if (s->symbol[i] != rule->sym) {
+    LS_COUNT(e->p, symbol_rejects, 1);
+    return false;
+  }
+  if (!bind_params(e, rule->next, slot + 1, s, i)) {
+    LS_COUNT(e->p, param_rejects, 1);
+    return false;
+  } return true;
 }
 
-sxp *ls_runner(lsystem *ls, sxp *words, int n) {
-  if (n <= 0)
-    return words;
-  return ls_runner(ls, ls_apply(ls, words), n-1);
+static bool attempt_match_flat(production *p, const ls_string *s,
+			       const std::vector<int> &br, int i, env *e) {
+  int nleft = p->left.size(), nright = p->right.size();
+  int j = i, k = nleft;
+  LS_COUNT(p, attempts, 1);
+
+  /* the left context, nearest first, on the walk back toward the root;
+     walking right again couldn't get back into the center's branch */
+  e->p = p;
+  e->bound = 0;
+  for (int n = nleft - 1; n >= 0; n--) {
+    if ((j = left_neighbour(br, j)) < 0) {
+      LS_COUNT(p, symbol_rejects, 1);
+      return false;
+    }
+    if (!ls_match_params(e, p->left[n], &p->slots[n][0], s, j))
+      return false;
+  }
+
+  if (!ls_match_params(e, p->center, &p->slots[k++][0], s, i))
+    return false;
+
+  j = i;
+  for (int n = 0; n < nright; n++, k++) {
+    if ((j = right_neighbour(br, j)) < 0) {
+      LS_COUNT(p, symbol_rejects, 1);
+      return false;
+    }
+    if (!ls_match_params(e, p->right[n], &p->slots[k][0], s, j))
+      return false;
+  } return true;
+}
+
+static void expand_flat(lsystem *ls, stochastic_expansion *x, env *e,
+			ls_string *out) {
+#ifdef LS_PROFILE
+  int from = ls_length(out);
+#endif
+  if (!ls->reference_eval)
+    vm_expand_flat(x->code, e, out);
+  else {
+    for (sxp *r = x->expansion; r; r = r->next) {
+      if (!ls_append_element(out, ls_eval_expr(e, r->down))) {
+	fprintf(stderr, "ls_apply_flat: expansion does not fit a flat string\n");
+	exit(-1);
+      }
+    }
+  }
+#ifdef LS_PROFILE
+  /* e->p is the production being expanded */
+  unsigned long long n = 0;
+  for (int i = from; i < ls_length(out); i++)
+    n += out->symbol[i] >= 0;
+  LS_COUNT(e->p, emitted, n);
+#endif
+}
+
+/* the span is taken only when it's traced, so the untraced call stays
+   as cheap as the expansion */
+void ls_expand_flat(lsystem *ls, stochastic_expansion *x, env *e,
+		    ls_string *out) {
+  if (ls_trace_detail < ls_trace_modules) {
+    expand_flat(ls, x, e, out);
+    return;
+  }
+
+  ls_span span;
+  ls_span_begin(&span, ls_trace_modules, "expand", 0, 0);
+  expand_flat(ls, x, e, out);
+  ls_span_end(&span);
+}
+
+/* the production that rewrites module i of in, with its bindings left
+   in e, or 0 if none applies (brackets included) */
+production *ls_match_flat(lsystem *ls, const ls_string *in, int i, env *e) {
+  int sym = in->symbol[i];
+  if (sym < 0 || sym >= ls->dispatch.size())
+    return 0;
+
+  std::vector<production *> &candidates = ls->dispatch[sym];
+  for (int j = 0; j < candidates.size(); j++) {
+    if (attempt_match_flat(candidates[j], in, ls->brackets, i, e)
+	&& ls_test_condition(ls, candidates[j], e))
+      return candidates[j];
+  } return 0;
+}
+
+/* ls_apply_flat's branch spans, for module detail only: a bracket of
+   in opens or closes one */
+static void trace_branch(const ls_string *in, int i,
+			 std::vector<ls_span> &branches) {
+  if (in->symbol[i] == LS_OPEN) {
+    branches.resize(branches.size() + 1);
+    ls_span_begin(&branches.back(), ls_trace_modules, "branch", "depth",
+		  branches.size());
+  } else if (in->symbol[i] == LS_CLOSE && !branches.empty()) {
+    ls_span_end(&branches.back());
+    branches.pop_back();
+  }
+}
+
+void ls_apply_flat(lsystem *ls, const ls_string *in, ls_string *out) {
+  env frame, *e = &frame;
+  int n = ls_length(in);
+  ls_span span, phase;
+  ls_span_begin(&span, ls_trace_phases, "generation", "generation",
+		ls->generation);
+
+  if (ls->has_context) {
+    ls_span_begin(&phase, ls_trace_phases, "index brackets", 0, 0);
+    ls_index_brackets(in, ls->brackets);
+    ls_span_end(&phase);
+  }
+
+  if (ls->compiled && !ls->reference_eval) {
+    ls_span_begin(&phase, ls_trace_phases, "compiled", 0, 0);
+    ls_apply_compiled(ls, in, out);
+    ls_span_end(&phase);
+    ls_span_end(&span);
+    if (ls->memory_limit && !ls_check_memory(ls))
+      return;
+    ++ls->generation;
+    return;
+  }
+
+  if (ls->pool && n >= LS_PARALLEL_MIN) {
+    ls_apply_parallel(ls, in, out, ls->pool);
+    ls_span_end(&span);
+    if (ls->memory_limit && !ls_check_memory(ls))
+      return;
+    ++ls->generation;
+    return;
+  }
+
+  bool branches = ls_trace_detail >= ls_trace_modules;
+  std::vector<ls_span> open;
+  ls_string_clear(out);
+  ls_span_begin(&phase, ls_trace_phases, "match", 0, 0);
+  for (int i = 0; i < n; i++) {
+    if (ls->memory_limit && i % LS_MEMORY_CHECK == 0 && !ls_check_memory(ls))
+      break;
+    if (branches)
+      trace_branch(in, i, open);
+    production *p = ls_match_flat(ls, in, i, e);
+
+    /* brackets and modules nothing applies to are copied */
+    if (!p) {
+      ls_push_copy(out, in, i);
+      continue;
+    }
+
+    stochastic_expansion *x = ls_select_expansion(ls, p, i);
+    if (x)
+      ls_expand_flat(ls, x, e, out);
+  } ls_span_end(&phase);
+  ls_span_end(&span);
+  if (!ls->over_budget)
+    ++ls->generation;
+}
+
+/* the generation that went over the budget, if any, is reported and
+   recorded in generation_memory */
+static bool over_budget(lsystem *ls, const char *who) {
+  if (!ls->over_budget)
+    return false;
+  fprintf(stderr, "%s: generation %d would hold more than %lu bytes\n",
+	  who, ls->generation + 1, (unsigned long) ls->memory_limit);
+  return true;
 }
 
 sxp *ls_run(lsystem *ls, int n) {
-  return ls_runner(ls, ls->axiom, n);
+  sxp *words = ls->axiom;
+  unsigned long long made[4];
+  ls->generation_bytes.assign(1, 0);
+  ls->generation = 0;
+  ls->over_budget = false;
+  ls->generation_memory.clear();
+  nodes_made(made);
+  record_memory(ls, made);
+
+  /* generation i+1 is built in one arena while generation i is still
+     readable in the other; then generation i's arena is released */
+  for (int i = 0; i < n; i++) {
+    sxp_arena *build = ls->arena[i & 1], *prev = ls->arena[(i + 1) & 1];
+    nodes_made(made);
+    sxp_arena_reset(build);
+    sxp_arena *old = sxp_set_arena(build);
+    words = ls_apply(ls, words);
+    sxp_set_arena(old);
+    record_memory(ls, made);
+    if (over_budget(ls, "ls_run"))
+      return 0;
+    if (i > 0)
+      sxp_arena_reset(prev);
+    ls->generation_bytes.push_back(sxp_arena_bytes(build));
+  } return words;
+}
+
+ls_string *ls_run_flat(lsystem *ls, int n) {
+  ls_string *cur = &ls->flat[0], *next = &ls->flat[1];
+
+  ls_string_clear(cur);
+  if (!ls_from_sxp(cur, ls->axiom)) {
+    fprintf(stderr, "ls_run_flat: axiom does not fit a flat string\n");
+    exit(-1);
+  } ls->generation_bytes.assign(1, ls_string_bytes(cur));
+  ls->generation = 0;
+  ls->over_budget = false;
+  ls->generation_memory.clear();
+  unsigned long long made[4];
+  nodes_made(made);
+  record_memory(ls, made);
+
+  /* the tree walker's temporaries go to the scratch arena */
+  sxp_arena *old = sxp_set_arena(ls->scratch);
+  for (int i = 0; i < n; i++) {
+    nodes_made(made);
+    sxp_arena_reset(ls->scratch);
+    ls_apply_flat(ls, cur, next);
+    record_memory(ls, made);
+    if (over_budget(ls, "ls_run_flat")) {
+      sxp_set_arena(old);
+      return 0;
+    }
+    std::swap(cur, next);
+    ls->generation_bytes.push_back(ls_string_bytes(cur));
+  } sxp_set_arena(old);
+
+  return cur;
+}
+
+ls_derivation *ls_begin(lsystem *ls, unsigned long long seed) {
+  ls_derivation *d = new ls_derivation;
+  d->ls = ls;
+  d->generation = -1;
+  d->bytes = 0;
+  d->words = 0;
+  d->arena[0] = sxp_arena_new();
+  d->arena[1] = sxp_arena_new();
+  d->seed = seed;
+  ls->over_budget = false;
+  return d;
+}
+
+/* ls_check_memory with what the derivation holds besides the lsystem.
+   it is checked once each step is done */
+static bool step_within_budget(ls_derivation *d) {
+  lsystem *ls = d->ls;
+  size_t held = ls_memory_held(ls) + sxp_arena_held(d->arena[0])
+    + sxp_arena_held(d->arena[1]) + string_bytes(&d->flat[0])
+    + string_bytes(&d->flat[1]);
+  if (ls->memory_limit && held > ls->memory_limit)
+    ls->over_budget = true;
+  return !ls->over_budget;
+}
+
+sxp *ls_step(ls_derivation *d) {
+  if (d->generation < 0) {
+    d->generation = 0;
+    d->words = d->ls->axiom;
+    return d->words;
+  }
+
+  /* same double buffering as ls_run: generation g+1 goes where g-1 was */
+  sxp_arena *build = d->arena[d->generation & 1];
+  sxp_arena_reset(build);
+  sxp_arena *old = sxp_set_arena(build);
+  ls_seed(d->ls, d->seed);
+  d->ls->generation = d->generation;
+  sxp *words = ls_apply(d->ls, d->words);
+  sxp_set_arena(old);
+  if (!step_within_budget(d)) {
+    d->ls->generation = d->generation;	/* the one it was rewriting */
+    over_budget(d->ls, "ls_step");
+    return 0;
+  }
+
+  d->words = words;
+  ++d->generation;
+  d->bytes = sxp_arena_bytes(build);
+  return d->words;
+}
+
+ls_string *ls_step_flat(ls_derivation *d) {
+  ls_string *cur = &d->flat[d->generation & 1];
+  ls_string *next = &d->flat[(d->generation + 1) & 1];
+
+  if (d->generation < 0) {
+    d->generation = 0;
+    ls_string_clear(&d->flat[0]);
+    if (!ls_from_sxp(&d->flat[0], d->ls->axiom)) {
+      fprintf(stderr, "ls_step_flat: axiom does not fit a flat string\n");
+      exit(-1);
+    } d->bytes = ls_string_bytes(&d->flat[0]);
+    return &d->flat[0];
+  }
+
+  /* the tree walker's temporaries go to a scratch arena */
+  sxp_arena_reset(d->arena[0]);
+  sxp_arena *old = sxp_set_arena(d->arena[0]);
+  ls_seed(d->ls, d->seed);
+  d->ls->generation = d->generation;
+  ls_apply_flat(d->ls, cur, next);
+  sxp_set_arena(old);
+  if (!step_within_budget(d)) {
+    d->ls->generation = d->generation;	/* the one it was rewriting */
+    over_budget(d->ls, "ls_step_flat");
+    return 0;
+  }
+
+  ++d->generation;
+  d->bytes = ls_string_bytes(next);
+  return next;
+}
+
+void ls_end(ls_derivation *d) {
+  sxp_arena_free(d->arena[0]);
+  sxp_arena_free(d->arena[1]);
+  delete d;
 }
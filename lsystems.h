@@ -2,37 +2,225 @@
 #define LSYSTEMS_H
 
 #include "sexp.h"
+#include "lsstring.h"
+#include <stdio.h>
 #include <vector>
-#include <map>
 #include <string>
 
+struct t_vm_program;
+struct t_vm_expansion;
+struct t_ls_compiled;
+
 typedef struct t_stochastic_expansion {
   float probability;
   sxp *expansion;
+  struct t_vm_expansion *code;	/* compiled expansion */
 } stochastic_expansion;
 
+/* per production counters, for finding the productions a slow grammar
+   spends its time in. they are only counted when the library is built
+   with -DLS_PROFILE; otherwise LS_COUNT is empty and they stay 0. the
+   parallel rewriter counts from several threads, so counts are added
+   atomically. see dump_profile */
+typedef struct t_ls_profile {
+  unsigned long long attempts;	/* modules the pattern was tried on */
+  unsigned long long symbol_rejects; /* a pattern module wasn't there:
+					the wrong name or no neighbour */
+  unsigned long long param_rejects; /* the names matched, the parameters
+				       didn't bind */
+  unsigned long long conditions; /* condition evaluations */
+  unsigned long long condition_ns;
+  unsigned long long condition_failures;
+  std::vector<unsigned long long> fired; /* expansion -> firings, with a
+					    last entry for draws past the
+					    last probability */
+  unsigned long long emitted;	/* modules its expansions produced,
+				   brackets not counted */
+
+  t_ls_profile() : attempts(0), symbol_rejects(0), param_rejects(0),
+		   conditions(0), condition_ns(0), condition_failures(0),
+		   emitted(0) {}
+} ls_profile;
+
+#ifdef LS_PROFILE
+#define LS_COUNT(p, counter, n) \
+  __atomic_fetch_add(&(p)->profile.counter, (n), __ATOMIC_RELAXED)
+#else
+#define LS_COUNT(p, counter, n)
+#endif
+
 typedef struct t_production {
+  int symbol;			/* symbol id of center, for quick rejects */
   std::vector<sxp *> left;
   sxp *center;
   std::vector<sxp *> right;
+  std::vector<int> params;	/* slot -> formal parameter symbol */
+  std::vector<std::vector<int> > slots;	/* per pattern module (left, center,
+					   right): slot of each node or -1 */
   sxp *condition;
+  struct t_vm_program *test;	/* compiled condition, 0 if not compiled */
   std::vector<stochastic_expansion *> expansion;
+  std::vector<double> cumulative; /* running sums of the expansion
+				     probabilities, for selection */
+  ls_profile profile;
+
+  /* what ls_optimize made of it, see lsopt.h */
+  int folded;			/* operations replaced by their value */
+  int simplified;		/* operands dropped, operations reduced to
+				   their one operand */
+  bool dead;			/* the condition is never true; it is left
+				   out of the dispatch table */
+  bool unconditional;		/* the condition was always true and is
+				   gone */
 } production;
 
 production *parse_production(sxp *def, bool stochastic);
 
+/* what a derivation holds after a generation of ls_run or ls_run_flat */
+typedef struct t_ls_memory {
+  size_t held;			/* the lsystem's arenas, strings and index,
+				   see ls_memory_held */
+  size_t live, peak;		/* all of sexp.c's, see sxp_memory */
+  size_t symbols;
+  unsigned long long nodes[4];	/* sxp nodes the generation made, by ty_* */
+} ls_memory;
+
 typedef struct t_lsystem {
+  sxp_arena *grammar;		/* holds the parsed definition */
+  sxp *definition;		/* its top level forms */
   sxp *axiom;
   std::vector<production *> productions;
+  std::vector<std::vector<production *> > dispatch; /* center symbol id ->
+						       productions, in
+						       declaration order */
+  std::vector<bool> rewritable;	/* symbol id -> some production rewrites
+				   it; ids past the end have none */
+  bool has_context;		/* any production has left or right context */
+
+  /* the string being rewritten, one entry per module or bracket. the
+     bracket table is built only when there is context to match */
+  std::vector<int> brackets;	/* see ls_index_brackets */
+  std::vector<sxp *> elements;	/* ls_apply's modules, 0 for brackets */
+
+  /* generations are built in alternating arenas, so the string returned
+     by ls_run stays valid until the next ls_run on the same lsystem */
+  sxp_arena *arena[2];
+  std::vector<size_t> generation_bytes; /* bytes per generation of the
+					   last ls_run or ls_run_flat. the
+					   axiom of ls_run counts 0 */
+
+  /* ls_run_flat rewrites between these, see ls_run */
+  ls_string flat[2];
+  sxp_arena *scratch;		/* temporaries of the flat rewriter */
+  struct t_ls_pool *pool;	/* threads for ls_apply_flat, see
+				   ls_set_threads */
+
+  bool reference_eval;		/* evaluate with the tree walker only */
+  struct t_ls_compiled *compiled; /* rewrites flat generations instead of
+				     the productions unless reference_eval,
+				     see ls_use_compiled */
+
+  /* the memory of the last ls_run or ls_run_flat, an entry per
+     generation with the axiom first. with a memory_limit other than 0, a
+     generation that takes ls_memory_held past it is abandoned partway:
+     over_budget is set and the run returns 0 instead of going on. the
+     rewriters check every LS_MEMORY_CHECK modules, the parallel and
+     compiled ones only once their generation is done */
+  std::vector<ls_memory> generation_memory;
+  size_t memory_limit;		/* bytes, 0 for none */
+  bool over_budget;
+
+  /* stochastic choices are drawn from (seed, generation, position), with
+     position the module's index in the flat string. the generation is
+     that of the string being rewritten; ls_run and ls_run_flat restart
+     it at 0, and each ls_apply or ls_apply_flat advances it */
+  unsigned long long seed;
+  int generation;
 } lsystem;
 
+/* a derivation in progress. ls_step returns generation 0 (the axiom),
+   then 1, 2, ..., each rewritten from the one before, so printing
+   generations 0..n costs n rewrites rather than n(n+1)/2 runs. it keeps
+   its own seed, so generation i matches ls_seed(ls, seed); ls_run(ls, i).
+   a string returned by a step stays valid until the step after next.
+   use either ls_step or ls_step_flat on one derivation, not both. with
+   the lsystem's memory_limit, a step that leaves the derivation holding
+   more sets over_budget and returns 0 */
+typedef struct t_ls_derivation {
+  lsystem *ls;
+  int generation;		/* of the string last returned */
+  size_t bytes;			/* its size, as in generation_bytes */
+  sxp *words;
+  sxp_arena *arena[2];
+  ls_string flat[2];
+  unsigned long long seed;
+} ls_derivation;
+
 lsystem *ls_load(char *file);
+lsystem *ls_load_from_buffer(const char *text, size_t len);
+/* load n files on up to threads threads into out, 0 where a file can't
+   be read or is malformed; returns the number loaded */
+int ls_load_many(char **paths, int n, lsystem **out, int threads);
+/* the same for the .ls files of dir, which are put in paths in name
+   order, with out matching them; -1 if dir can't be read */
+int ls_load_directory(const char *dir, std::vector<std::string> &paths,
+		      std::vector<lsystem *> &out, int threads);
+void ls_build_dispatch(lsystem *ls);
 sxp *ls_apply(lsystem *ls, sxp *state);
 sxp *ls_run(lsystem *ls, int n);
+void ls_apply_flat(lsystem *ls, const ls_string *in, ls_string *out);
+ls_string *ls_run_flat(lsystem *ls, int n);
+void ls_set_threads(lsystem *ls, int threads);
+void ls_seed(lsystem *ls, unsigned long long seed);
+ls_derivation *ls_begin(lsystem *ls, unsigned long long seed);
+sxp *ls_step(ls_derivation *d);
+ls_string *ls_step_flat(ls_derivation *d);
+void ls_end(ls_derivation *d);
 void dump_lsystem(lsystem *ls);
+void dump_profile(lsystem *ls, FILE *f);	/* json */
+void dump_memory(lsystem *ls, FILE *f);		/* json */
+void dump_optimization(lsystem *ls, FILE *f);	/* json */
+void ls_profile_reset(lsystem *ls);
+
+#define LS_MEMORY_CHECK 1024
+
+/* bytes held by what ls_run and ls_run_flat derive into, and by the
+   grammar: the structures loading allocated and the parsed definition */
+size_t ls_memory_held(lsystem *ls);
+size_t ls_grammar_bytes(lsystem *ls);
+bool ls_check_memory(lsystem *ls);	/* false, and over_budget, if over */
 
 /* functions that are really only used within lsystems.cc */
-typedef std::map<std::string, double> env;
+/* parameter bindings for one match attempt. the frame is reused from
+   attempt to attempt; clearing bound is all it takes to reset it */
+#define LS_MAX_SLOTS 64
+#define LS_SLOT_BIT(i) (1ULL << (i))
+
+typedef struct t_env {
+  production *p;		/* names the slots */
+  unsigned long long bound;
+  double slot[LS_MAX_SLOTS];
+} env;
+
+bool ls_env_lookup(env *e, int sym, double *v);
+
+/* the steps of ls_apply_flat, shared with the parallel rewriter.
+   ls_match_flat reads the brackets of in from ls->brackets */
+production *ls_match_flat(lsystem *ls, const ls_string *in, int i, env *e);
+bool ls_match_params(env *e, sxp *rule, const int *slot,
+		     const ls_string *s, int i);
+bool ls_test_condition(lsystem *ls, production *p, env *e);
+stochastic_expansion *ls_select_expansion(lsystem *ls, production *p,
+					  unsigned int position);
+void ls_expand_flat(lsystem *ls, stochastic_expansion *x, env *e,
+		    ls_string *out);
+
+enum {
+  op_none, op_add, op_sub, op_mul, op_div, op_lt, op_gt, op_lte, op_gte,
+  op_eq, op_and, op_or, op_not
+};
+
+int ls_operator(int sym);
 
 sxp *ls_eval_expr(env *e, sxp *expr);
 sxp *ls_eval_add(env *e, sxp *expr);
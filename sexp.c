@@ -3,11 +3,246 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* symbol table. interning takes a lock, so parsers on different threads
+   can share the table. names are read without one: a name never moves
+   once it's stored, and the id -> name array is copied rather than
+   reallocated when it grows, the old copy being kept for readers that
+   may still have it */
+
+static char **sym_names = 0;	/* id -> name */
+static int sym_count = 0, sym_cap = 0;
+static int *sym_hash = 0;	/* open addressing, holds id+1, 0 if empty */
+static int sym_hash_size = 0;
+static pthread_mutex_t sym_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* memory accounting: bytes taken from malloc and still held, by what
+   holds them. nodes made are counted per thread, so the constructors do
+   no atomics */
+static size_t held_live, held_peak, held_arenas, held_nodes, held_symbols;
+static __thread unsigned long long nodes_made[4];
+
+static void held_add(size_t *what, size_t n) {
+  size_t live, peak;
+  __atomic_add_fetch(what, n, __ATOMIC_RELAXED);
+  live = __atomic_add_fetch(&held_live, n, __ATOMIC_RELAXED);
+  peak = __atomic_load_n(&held_peak, __ATOMIC_RELAXED);
+  while (live > peak &&
+	 !__atomic_compare_exchange_n(&held_peak, &peak, live, 1,
+				      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+static void held_sub(size_t *what, size_t n) {
+  __atomic_sub_fetch(what, n, __ATOMIC_RELAXED);
+  __atomic_sub_fetch(&held_live, n, __ATOMIC_RELAXED);
+}
+
+void sxp_memory_stats(sxp_memory *m) {
+  m->live = __atomic_load_n(&held_live, __ATOMIC_RELAXED);
+  m->peak = __atomic_load_n(&held_peak, __ATOMIC_RELAXED);
+  m->arenas = __atomic_load_n(&held_arenas, __ATOMIC_RELAXED);
+  m->nodes = __atomic_load_n(&held_nodes, __ATOMIC_RELAXED);
+  m->symbols = __atomic_load_n(&held_symbols, __ATOMIC_RELAXED);
+  memcpy(m->made, nodes_made, sizeof(m->made));
+}
+
+void sxp_memory_reset_peak() {
+  __atomic_store_n(&held_peak, __atomic_load_n(&held_live, __ATOMIC_RELAXED),
+		   __ATOMIC_RELAXED);
+}
+
+static unsigned int sym_hashfn(const char *s, size_t len) {
+  unsigned int h = 2166136261u;
+  while (len--)
+    h = (h ^ (unsigned char) *s++) * 16777619u;
+  return h;
+}
+
+static void sym_rehash(int size) {
+  int i;
+  free(sym_hash);
+  held_sub(&held_symbols, sym_hash_size * sizeof(int));
+  sym_hash = (int *) calloc(size, sizeof(int));
+  held_add(&held_symbols, size * sizeof(int));
+  sym_hash_size = size;
+  for (i = 0; i < sym_count; i++) {
+    unsigned int h = sym_hashfn(sym_names[i], strlen(sym_names[i])) & (size - 1);
+    while (sym_hash[h])
+      h = (h + 1) & (size - 1);
+    sym_hash[h] = i + 1;
+  }
+}
+
+int sxp_intern(const char *name) {
+  return sxp_intern_n(name, strlen(name));
+}
+
+static int intern_locked(const char *name, size_t len) {
+  unsigned int h;
+  int id;
+
+  if (2 * (sym_count + 1) > sym_hash_size)
+    sym_rehash(sym_hash_size ? 2 * sym_hash_size : 256);
+
+  h = sym_hashfn(name, len) & (sym_hash_size - 1);
+  while ((id = sym_hash[h])) {
+    char *known = sym_names[id - 1];
+    if (!strncmp(known, name, len) && !known[len])
+      return id - 1;
+    h = (h + 1) & (sym_hash_size - 1);
+  }
+
+  if (sym_count == sym_cap) {
+    int cap = sym_cap ? 2 * sym_cap : 128;
+    char **names = (char **) malloc(cap * sizeof(char *));
+    held_add(&held_symbols, cap * sizeof(char *));
+    if (sym_count)
+      memcpy(names, sym_names, sym_count * sizeof(char *));
+    __atomic_store_n(&sym_names, names, __ATOMIC_RELEASE);
+    sym_cap = cap;
+  }
+  char *known = (char *) malloc(len + 1);
+  held_add(&held_symbols, len + 1);
+  memcpy(known, name, len);
+  known[len] = 0;
+  sym_names[sym_count] = known;
+  sym_hash[h] = sym_count + 1;
+  __atomic_store_n(&sym_count, sym_count + 1, __ATOMIC_RELEASE);
+  return sym_count - 1;
+}
+
+int sxp_intern_n(const char *name, size_t len) {
+  pthread_mutex_lock(&sym_lock);
+  int id = intern_locked(name, len);
+  pthread_mutex_unlock(&sym_lock);
+  return id;
+}
+
+const char *sxp_symbol_name(int sym) {
+  if (sym < 0 || sym >= __atomic_load_n(&sym_count, __ATOMIC_ACQUIRE))
+    return "[bad symbol]";
+  return __atomic_load_n(&sym_names, __ATOMIC_ACQUIRE)[sym];
+}
+
+int sxp_symbol_count() {
+  return __atomic_load_n(&sym_count, __ATOMIC_ACQUIRE);
+}
+
+/* arenas */
+
+typedef struct t_arena_block {
+  struct t_arena_block *next;
+  size_t size, used;
+  double data[1];		/* aligned storage, really size bytes */
+} arena_block;
+
+struct t_sxp_arena {
+  arena_block *first, *current;
+  size_t bytes;
+  size_t held;			/* its blocks, used or not */
+};
+
+/* where sxp_make* allocates, 0 for malloc. each thread selects its own */
+static __thread sxp_arena *arena = 0;
+
+sxp_arena *sxp_arena_new() {
+  sxp_arena *a = (sxp_arena *) malloc(sizeof(sxp_arena));
+  a->first = a->current = 0;
+  a->bytes = 0;
+  a->held = sizeof(sxp_arena);
+  held_add(&held_arenas, a->held);
+  return a;
+}
+
+void *sxp_arena_alloc(sxp_arena *a, size_t size) {
+  arena_block *b = a->current;
+  size = (size + 7) & ~(size_t) 7;
+
+  if (!b || b->used + size > b->size) {
+    /* move on to the next retained block, or chain a new one */
+    if (b && b->next && b->next->size >= size) {
+      b = b->next;
+      b->used = 0;
+    } else {
+      size_t bsize = b ? 2 * b->size : 64 * 1024;
+      arena_block *n;
+      while (bsize < size)
+	bsize *= 2;
+      n = (arena_block *) malloc(sizeof(arena_block) + bsize);
+      a->held += sizeof(arena_block) + bsize;
+      held_add(&held_arenas, sizeof(arena_block) + bsize);
+      n->size = bsize;
+      n->used = 0;
+      if (b) {
+	n->next = b->next;
+	b->next = n;
+      } else {
+	n->next = a->first;
+	a->first = n;
+      } b = n;
+    } a->current = b;
+  }
+
+  void *p = (char *) b->data + b->used;
+  b->used += size;
+  a->bytes += size;
+  return p;
+}
+
+/* forget everything allocated; blocks are kept for the next user */
+void sxp_arena_reset(sxp_arena *a) {
+  a->current = a->first;
+  if (a->first)
+    a->first->used = 0;
+  a->bytes = 0;
+}
+
+void sxp_arena_free(sxp_arena *a) {
+  arena_block *b = a->first, *t;
+  while (b) {
+    t = b->next;
+    free(b);
+    b = t;
+  }
+  held_sub(&held_arenas, a->held);
+  free(a);
+}
+
+size_t sxp_arena_bytes(sxp_arena *a) {
+  return a->bytes;
+}
+
+size_t sxp_arena_held(sxp_arena *a) {
+  return a->held;
+}
+
+sxp_arena *sxp_set_arena(sxp_arena *a) {
+  sxp_arena *old = arena;
+  arena = a;
+  return old;
+}
 
 /* memory management */
 
+static sxp *sxp_alloc(int type) {
+  nodes_made[type]++;
+  if (arena)
+    return (sxp *) sxp_arena_alloc(arena, sizeof(sxp));
+  held_add(&held_nodes, sizeof(sxp));
+  return (sxp *) malloc(sizeof(sxp));
+}
+
 sxp *sxp_makeint(int Z, sxp *n) {
-  sxp *s = (sxp *) malloc(sizeof(sxp));
+  sxp *s = sxp_alloc(ty_integer);
   s->type = ty_integer;
   s->Z = Z;
   s->next = n;
@@ -15,7 +250,7 @@ sxp *sxp_makeint(int Z, sxp *n) {
 }
 
 sxp *sxp_makefloat(double R, sxp *n) {
-  sxp *s = (sxp *) malloc(sizeof(sxp));
+  sxp *s = sxp_alloc(ty_float);
   s->type = ty_float;
   s->R = R;
   s->next = n;
@@ -23,15 +258,19 @@ sxp *sxp_makefloat(double R, sxp *n) {
 }
 
 sxp *sxp_makesymbol(char *sym, sxp *n) {
-  sxp *s = (sxp *) malloc(sizeof(sxp));
+  return sxp_makesym(sxp_intern(sym), n);
+}
+
+sxp *sxp_makesym(int sym, sxp *n) {
+  sxp *s = sxp_alloc(ty_symbol);
   s->type = ty_symbol;
-  s->symbol = strdup(sym);
+  s->sym = sym;
   s->next = n;
   return s;
 }
 
 sxp *sxp_makesxp(sxp *d, sxp *n) {
-  sxp *s = (sxp *) malloc(sizeof(sxp));
+  sxp *s = sxp_alloc(ty_sxp);
   s->type = ty_sxp;
   s->down = d;
   s->next = n;
@@ -43,19 +282,37 @@ void sxp_dest(sxp *x) {
   while (x) {
     t = x->next;
 
-    switch (x->type) {
-    case ty_symbol:
-      free(x->symbol);
-      break;
-    case ty_sxp:
+    if (x->type == ty_sxp)
       sxp_dest(x->down);
-      break;
-    } free(x);
+    free(x);
+    held_sub(&held_nodes, sizeof(sxp));
 
     x = t;
   } 
 }
 
+/* deep copy into the current allocator */
+sxp *sxp_copy(sxp *x) {
+  sxp *s = 0, **tail = &s;
+  while (x) {
+    switch (x->type) {
+    case ty_sxp:
+      *tail = sxp_makesxp(sxp_copy(x->down), 0);
+      break;
+    case ty_integer:
+      *tail = sxp_makeint(x->Z, 0);
+      break;
+    case ty_float:
+      *tail = sxp_makefloat(x->R, 0);
+      break;
+    case ty_symbol:
+      *tail = sxp_makesym(x->sym, 0);
+      break;
+    } tail = &(*tail)->next;
+    x = x->next;
+  } return s;
+}
+
 /* print for debugging purposes */
 
 void sxp_print(sxp *x) {
@@ -73,7 +330,7 @@ void sxp_print(sxp *x) {
       printf(" float:%f", x->R);
       break;
     case ty_symbol:
-      printf(" %s", x->symbol);
+      printf(" %s", sxp_symbol_name(x->sym));
       break;
     } x = x->next;
   } 
@@ -85,7 +342,8 @@ static int dummy_reader() {
   return -1;
 }
 
-static int (*readchar)(void) = dummy_reader;
+/* the reader is per thread, like the arena */
+static __thread int (*readchar)(void) = dummy_reader;
 
 void set_reader(int (*read)(void)) {
   readchar = read;
@@ -101,6 +359,8 @@ static sxp *sxp_parse_item(char *buf) {
   char *p = buf;
   int type = ty_integer;
 
+  if (p[0] == '-' && p[1])
+    ++p;			/* a sign */
   while (*p) {
     if (!isdigit(*p)) {
       type = ty_float;
@@ -127,7 +387,7 @@ sxp *sxp_next() {
 
   sxp *start_fragment = 0;
   sxp *current = 0, *t;
-  char buf[256];
+  char buf[512];		/* the longest float ls_text writes is ~330 */
   
   c = readchar();
   while (parse) {
@@ -150,6 +410,10 @@ sxp *sxp_next() {
     else if (is_item(c)) {
       char *p = buf;
       while (is_item(c)) {
+	if (p == buf + sizeof(buf) - 1) {
+	  fprintf(stderr, "sxp_next encountered an item too long to read\n");
+	  exit(-1);
+	}
 	*p++ = c;
 	c = readchar();
       } *p = 0;
@@ -170,6 +434,244 @@ sxp *sxp_next() {
   return start_fragment;
 }
 
+/* parsing from memory. this reads exactly what sxp_next reads, without
+   the per character calls: tokens are sliced out of the text instead of
+   copied, and are found 16 characters at a time where SSE2 is there */
+
+/* the end of the item at p. in the C locale, isalnum or ispunct is any
+   printable character but space */
+static const char *item_end(const char *p, const char *end) {
+#ifdef __SSE2__
+  const __m128i space = _mm_set1_epi8(' '), del = _mm_set1_epi8(0x7f);
+  const __m128i open = _mm_set1_epi8('('), close = _mm_set1_epi8(')');
+  while (end - p >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) p);
+    /* signed compares, so bytes over 0x7f are out as well */
+    __m128i in = _mm_and_si128(_mm_cmpgt_epi8(v, space), _mm_cmplt_epi8(v, del));
+    __m128i paren = _mm_or_si128(_mm_cmpeq_epi8(v, open), _mm_cmpeq_epi8(v, close));
+    int stop = ~_mm_movemask_epi8(_mm_andnot_si128(paren, in)) & 0xffff;
+    if (stop)
+      return p + __builtin_ctz(stop);
+    p += 16;
+  }
+#endif
+  while (p < end && is_item((unsigned char) *p))
+    ++p;
+  return p;
+}
+
+static const char *skip_space(const char *p, const char *end) {
+#ifdef __SSE2__
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i below = _mm_set1_epi8('\t' - 1), above = _mm_set1_epi8('\r' + 1);
+  while (end - p >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) p);
+    __m128i ws = _mm_or_si128(_mm_cmpeq_epi8(v, space),
+			      _mm_and_si128(_mm_cmpgt_epi8(v, below),
+					    _mm_cmplt_epi8(v, above)));
+    int stop = ~_mm_movemask_epi8(ws) & 0xffff;
+    if (stop)
+      return p + __builtin_ctz(stop);
+    p += 16;
+  }
+#endif
+  while (p < end && isspace((unsigned char) *p))
+    ++p;
+  return p;
+}
+
+/* fall back to the library on a terminated copy */
+static double slow_number(const char *p, size_t len, int type) {
+  char small[64], *buf = len < sizeof(small) ? small : (char *) malloc(len + 1);
+  double v;
+  memcpy(buf, p, len);
+  buf[len] = 0;
+  v = type == ty_integer ? atoi(buf) : atof(buf);
+  if (buf != small)
+    free(buf);
+  return v;
+}
+
+/* digits with at least one '.'; like atof, a second '.' ends it. when
+   the digits fit 53 bits and there are at most 22 after the point, both
+   the digits and the power of ten are exact doubles and one correctly
+   rounded division gives atof's answer (Clinger's fast path) */
+static double parse_float(const char *p, size_t len) {
+  static const double tens[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+  };
+  unsigned long long m = 0;
+  int frac = 0, point = 0;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    if (p[i] == '.') {
+      if (point)
+	break;
+      point = 1;
+      continue;
+    }
+    if (m >= (1ULL << 53) / 10)
+      return slow_number(p, len, ty_float);
+    m = m * 10 + (p[i] - '0');
+    frac += point;
+  }
+
+  if (frac > 22)
+    return slow_number(p, len, ty_float);
+  return (double) m / tens[frac];
+}
+
+/* a number is digits and '.'s after an optional '-'; anything else is a
+   symbol, '-' on its own included */
+static sxp *parse_item(const char *p, size_t len) {
+  int type = ty_integer;
+  size_t i, sign = len > 1 && p[0] == '-';
+
+  for (i = sign; i < len; i++) {
+    if (p[i] < '0' || p[i] > '9') {
+      type = ty_float;
+      if (p[i] != '.') {
+	type = ty_symbol;
+	break;
+      }
+    }
+  }
+
+  switch (type) {
+  case ty_integer:
+    if (len - sign <= 9) {
+      int v = 0;
+      for (i = sign; i < len; i++)
+	v = v * 10 + (p[i] - '0');
+      return sxp_makeint(sign ? -v : v, 0);
+    } return sxp_makeint((int) slow_number(p, len, ty_integer), 0);
+  case ty_float: {
+    double v = parse_float(p + sign, len - sign);
+    return sxp_makefloat(sign ? -v : v, 0);
+  }
+  }
+  return sxp_makesym(sxp_intern_n(p, len), 0);
+}
+
+static sxp *parse_list(sxp_parser *ps);
+
+/* the next element of the list being read. 0 at the end of the text, or
+   at the ')' that ends the list, which is consumed */
+static sxp *parse_next(sxp_parser *ps) {
+  for (;;) {
+    if (ps->error)
+      return 0;
+    ps->p = skip_space(ps->p, ps->end);
+    if (ps->p == ps->end)
+      return 0;
+
+    char c = *ps->p;
+    if (c == '(') {
+      ++ps->p;
+      return sxp_makesxp(parse_list(ps), 0);
+    } else if (c == ')') {
+      ++ps->p;
+      return 0;
+    } else if (c == ';') {
+      const char *nl = (const char *) memchr(ps->p, '\n', ps->end - ps->p);
+      ps->p = nl ? nl : ps->end;
+    } else if (is_item((unsigned char) c)) {
+      const char *e = item_end(ps->p, ps->end);
+      sxp *t = parse_item(ps->p, e - ps->p);
+      ps->p = e;
+      return t;
+    } else {
+      fprintf(stderr, "sxp_parse encountered unexpected character\n");
+      ps->error = 1;
+    }
+  }
+}
+
+static sxp *parse_list(sxp_parser *ps) {
+  sxp *start_fragment = 0, *current = 0, *t;
+
+  while ((t = parse_next(ps))) {
+    if (current == 0) {
+      start_fragment = current = t;
+    } else {
+      current->next = t;
+      current = t;
+    }
+  }
+
+  return start_fragment;
+}
+
+void sxp_parser_init(sxp_parser *ps, const char *text, size_t len) {
+  ps->p = text;
+  ps->end = text + len;
+  ps->error = 0;
+}
+
+sxp *sxp_parser_next(sxp_parser *ps) {
+  return parse_next(ps);
+}
+
+int sxp_parse(const char *text, size_t len, sxp **x) {
+  sxp_parser ps;
+  sxp_parser_init(&ps, text, len);
+  *x = parse_list(&ps);
+  return !ps.error;
+}
+
+/* files that can't be mapped, such as pipes, are read into memory */
+static char *read_all(int fd, size_t *len) {
+  size_t cap = 65536, n = 0;
+  char *buf = (char *) malloc(cap);
+  ssize_t got;
+
+  while ((got = read(fd, buf + n, cap - n)) > 0) {
+    n += got;
+    if (n == cap)
+      buf = (char *) realloc(buf, cap *= 2);
+  }
+  if (got < 0) {
+    free(buf);
+    return 0;
+  }
+  *len = n;
+  return buf;
+}
+
+int sxp_load(const char *path, sxp **x) {
+  struct stat st;
+  int parsed;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return 0;
+
+  *x = 0;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    size_t len = st.st_size;
+    void *text = len ? mmap(0, len, PROT_READ, MAP_PRIVATE, fd, 0) : 0;
+    if (text != MAP_FAILED) {
+      close(fd);
+      if (!len)
+	return 1;
+      madvise(text, len, MADV_SEQUENTIAL);
+      parsed = sxp_parse((const char *) text, len, x);
+      munmap(text, len);
+      return parsed;
+    }
+  }
+
+  size_t len;
+  char *text = read_all(fd, &len);
+  close(fd);
+  if (!text)
+    return 0;
+  parsed = sxp_parse(text, len, x);
+  free(text);
+  return parsed;
+}
+
 int sxp_isequal(sxp *a, sxp *b) {
   if (a == b)
     return 1;
@@ -192,7 +694,7 @@ int sxp_isequal(sxp *a, sxp *b) {
       return 0;
     break;
   case ty_symbol:
-    if (strcmp(a->symbol, b->symbol))
+    if (a->sym != b->sym)
       return 0;
     break;
   } return sxp_isequal(a->next, b->next);
@@ -1,6 +1,8 @@
 #ifndef SEXP_H
 #define SEXP_H
 
+#include <stddef.h>
+
 enum {
   ty_float, ty_integer, ty_symbol, ty_sxp
 };
@@ -10,7 +12,7 @@ typedef struct t_sxp {
   union {
     int Z;
     double R;
-    char *symbol;
+    int sym;			/* interned symbol id */
     struct t_sxp *down;
   };
   struct t_sxp *next;
@@ -19,13 +21,70 @@ typedef struct t_sxp {
 sxp *sxp_makeint(int Z, sxp *n);
 sxp *sxp_makefloat(double R, sxp *n);
 sxp *sxp_makesymbol(char *sym, sxp *n);
+sxp *sxp_makesym(int sym, sxp *n);
 sxp *sxp_makesxp(sxp *d, sxp *n);
 void sxp_dest(sxp *x);
+sxp *sxp_copy(sxp *x);
 void sxp_print(sxp *x);
 
-void set_reader(int (*read)(void));
+/* symbol table: every symbol name is stored once and identified by a
+   small integer id, so symbols compare with == instead of strcmp. it is
+   shared by all threads and safe to use from any of them */
+int sxp_intern(const char *name);
+int sxp_intern_n(const char *name, size_t len); /* name needn't end in 0 */
+const char *sxp_symbol_name(int sym);
+int sxp_symbol_count();
+
+/* arenas: while an arena is selected with sxp_set_arena, the sxp_make*
+   constructors bump allocate out of it instead of calling malloc. nodes
+   in an arena are never passed to sxp_dest; the whole arena is released
+   at once with sxp_arena_reset, which keeps its blocks for reuse. the
+   selection is per thread */
+typedef struct t_sxp_arena sxp_arena;
+
+sxp_arena *sxp_arena_new();
+void *sxp_arena_alloc(sxp_arena *a, size_t size);
+void sxp_arena_reset(sxp_arena *a);
+void sxp_arena_free(sxp_arena *a);
+size_t sxp_arena_bytes(sxp_arena *a);
+size_t sxp_arena_held(sxp_arena *a);	/* its blocks, bytes in use or not */
+sxp_arena *sxp_set_arena(sxp_arena *a);	/* returns the previous arena */
+
+/* what sexp.c holds from malloc: arenas and their blocks, nodes made
+   without an arena, and the symbol table. live and peak are of the whole
+   process; made counts the nodes each constructor made on the calling
+   thread, by ty_* */
+typedef struct t_sxp_memory {
+  size_t live, peak;		/* bytes */
+  size_t arenas, nodes, symbols; /* live, by what holds it */
+  unsigned long long made[4];
+} sxp_memory;
+
+void sxp_memory_stats(sxp_memory *m);
+void sxp_memory_reset_peak();		/* to what's live now */
+
+void set_reader(int (*read)(void));	/* per thread */
 sxp *sxp_next();
 
+/* a parse of text in memory. the parser holds all the state of the
+   parse, so parsers on different threads don't interfere; nodes go to
+   the arena selected on the thread that calls sxp_parser_next, which
+   returns the top level forms one at a time, 0 after the last or once
+   the text turns out to be malformed, which sets error */
+typedef struct t_sxp_parser {
+  const char *p, *end;
+  int error;
+} sxp_parser;
+
+void sxp_parser_init(sxp_parser *ps, const char *text, size_t len);
+sxp *sxp_parser_next(sxp_parser *ps);
+
+/* the whole text parsed at once, and a file, which is mapped
+   rather than read where it can be. both return 0 if the text is
+   malformed, and sxp_load if the file can't be read */
+int sxp_parse(const char *text, size_t len, sxp **x);
+int sxp_load(const char *path, sxp **x);
+
 int sxp_length(sxp *s);
 int sxp_isequal(sxp *a, sxp *b);
 